@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "perf_counters.h"
+
+// Times one or more builds of the analysis binary over the benchmark images.
+//
+// usage: bench_runner <repeats> <label>=<command> [<label>=<command> ...]
+//                     -- <image> [<image> ...]
+//
+// Each command is run once per image and repeat, from the current directory,
+// and the best and median wall time are reported. When several commands are
+// given, the median is also reported relative to the first one, which makes
+// it easy to compare e.g. a release build against its PGO counterpart.
+//
+// Where perf counters are available, the median data-TLB misses per run
+// (of the command and everything it spawns) are reported too, e.g. to
+// compare huge page policies.
+
+struct Candidate {
+  std::string label;
+  std::string command;
+};
+
+struct Run {
+  double seconds;
+  PerfSample counters;
+};
+
+Run run_timed(const std::string &command, PerfCounters &counters) {
+  counters.start();
+  auto start = std::chrono::steady_clock::now();
+  int status = std::system(command.c_str());
+  auto end = std::chrono::steady_clock::now();
+  PerfSample sample = counters.stop();
+
+  if (status != 0) {
+    throw std::runtime_error("command failed: " + command);
+  }
+  return {std::chrono::duration<double>(end - start).count(), sample};
+}
+
+int main(const int argc, const char **argv) {
+  if (argc < 4) {
+    throw std::runtime_error(
+        "usage: bench_runner <repeats> <label>=<command>... -- <image>...");
+  }
+
+  int repeats = std::max(std::atoi(argv[1]), 1);
+  const char *quiet = std::getenv("BENCH_VERBOSE") ? "" : " > /dev/null";
+
+  std::vector<Candidate> candidates;
+  std::vector<std::string> images;
+  bool reading_images = false;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      reading_images = true;
+    } else if (reading_images) {
+      images.push_back(arg);
+    } else {
+      size_t split = arg.find('=');
+      if (split == std::string::npos) {
+        throw std::runtime_error("expected <label>=<command>, got " + arg);
+      }
+      candidates.push_back({arg.substr(0, split), arg.substr(split + 1)});
+    }
+  }
+
+  if (candidates.empty() || images.empty()) {
+    throw std::runtime_error("no commands or images given");
+  }
+
+  PerfCounters counters;
+
+  std::cout << std::left << std::setw(16) << "image" << std::setw(12)
+            << "build" << std::right << std::setw(10) << "best s"
+            << std::setw(10) << "median s" << std::setw(10) << "speedup"
+            << std::setw(12) << "dTLB M" << std::endl;
+
+  for (const std::string &image : images) {
+    double baseline = 0;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      std::vector<double> times, dtlb_misses;
+      for (int r = 0; r < repeats; ++r) {
+        Run run = run_timed(candidates[c].command + " " + image + quiet,
+                            counters);
+        times.push_back(run.seconds);
+        if (run.counters.valid[PERF_DTLB_MISSES]) {
+          dtlb_misses.push_back(
+              static_cast<double>(run.counters.values[PERF_DTLB_MISSES]));
+        }
+      }
+      std::sort(times.begin(), times.end());
+      std::sort(dtlb_misses.begin(), dtlb_misses.end());
+      double median = times[times.size() / 2];
+      if (c == 0) {
+        baseline = median;
+      }
+
+      std::string name = image.substr(image.find_last_of('/') + 1);
+      std::cout << std::left << std::setw(16) << name << std::setw(12)
+                << candidates[c].label << std::right << std::fixed
+                << std::setprecision(3) << std::setw(10) << times.front()
+                << std::setw(10) << median << std::setw(9)
+                << std::setprecision(2) << baseline / median << "x";
+      if (dtlb_misses.empty()) {
+        std::cout << std::setw(12) << "n/a";
+      } else {
+        std::cout << std::setw(12)
+                  << dtlb_misses[dtlb_misses.size() / 2] / 1e6;
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include "synthesize.h"
+
+#include <algorithm>
+#include <random>
+
+namespace {
+
+void fill_rect(std::vector<unsigned char> &pixels, int width, int height,
+               int x0, int y0, int w, int h, unsigned char value) {
+  for (int y = std::max(y0, 0); y < std::min(y0 + h, height); ++y) {
+    for (int x = std::max(x0, 0); x < std::min(x0 + w, width); ++x) {
+      size_t index = (static_cast<size_t>(y) * width + x) * 3;
+      pixels[index] = pixels[index + 1] = pixels[index + 2] = value;
+    }
+  }
+}
+
+} // namespace
+
+std::vector<unsigned char> synthesize(const SynthImage &spec, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> noise(-spec.noise, spec.noise);
+
+  std::vector<unsigned char> pixels(static_cast<size_t>(spec.width) *
+                                    spec.height * 3);
+  for (unsigned char &pixel : pixels) {
+    pixel = static_cast<unsigned char>(std::clamp(230 + noise(rng), 0, 255));
+  }
+
+  std::uniform_int_distribution<int> pos_x(0, spec.width - 1);
+  std::uniform_int_distribution<int> pos_y(0, spec.height - 1);
+  std::uniform_int_distribution<int> run_w(8, 90), run_h(3, 14);
+  std::uniform_int_distribution<int> ink(0, 100);
+
+  for (int i = 0; i < spec.feature_count; ++i) {
+    fill_rect(pixels, spec.width, spec.height, pos_x(rng), pos_y(rng),
+              run_w(rng), run_h(rng), static_cast<unsigned char>(ink(rng)));
+  }
+
+  return pixels;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A deterministic synthetic RGB image: a light, noisy background with dark
+// strokes and blocks drawn on it.
+struct SynthImage {
+  const char *name;
+  int width, height;
+  int feature_count; // number of dark strokes/blocks drawn
+  int noise;         // amplitude of the uniform background noise
+};
+
+// The interleaved RGB pixels of `spec`, the same for the same seed.
+std::vector<unsigned char> synthesize(const SynthImage &spec, uint32_t seed);
@@ -0,0 +1,63 @@
+# Two-step profile-guided build, run by the `pgo` target:
+#
+#   1. configure BUILD_DIR with ANALYSIS_PGO=GENERATE and build it,
+#   2. run the instrumented binary over the PNGs in TRAINING_DIR,
+#   3. reconfigure the same tree with ANALYSIS_PGO=USE and rebuild.
+
+foreach(var SOURCE_DIR BUILD_DIR GENERATOR CXX_COMPILER TRAINING_DIR)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "pgo.cmake: ${var} not set")
+  endif()
+endforeach()
+
+set(profile_dir "${BUILD_DIR}/profile")
+
+function(run_step)
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "pgo step failed: ${ARGN}")
+  endif()
+endfunction()
+
+function(configure_phase phase)
+  run_step(${CMAKE_COMMAND} -S "${SOURCE_DIR}" -B "${BUILD_DIR}"
+           -G "${GENERATOR}"
+           -DCMAKE_BUILD_TYPE=Release
+           -DCMAKE_CXX_COMPILER=${CXX_COMPILER}
+           -DSTB_INCLUDE_DIR=${STB_INCLUDE_DIR}
+           -DANALYSIS_NATIVE=${ANALYSIS_NATIVE}
+           -DANALYSIS_LTO=${ANALYSIS_LTO}
+           -DANALYSIS_PGO=${phase}
+           -DANALYSIS_PGO_DIR=${profile_dir})
+  run_step(${CMAKE_COMMAND} --build "${BUILD_DIR}" --target analysis)
+endfunction()
+
+message(STATUS "pgo: building instrumented binary")
+file(REMOVE_RECURSE "${profile_dir}")
+file(MAKE_DIRECTORY "${profile_dir}")
+configure_phase(GENERATE)
+
+message(STATUS "pgo: training")
+file(GLOB training_images "${TRAINING_DIR}/*.png")
+if(NOT training_images)
+  message(FATAL_ERROR "pgo: no training images in ${TRAINING_DIR}")
+endif()
+foreach(image IN LISTS training_images)
+  run_step("${BUILD_DIR}/analysis" "${image}"
+           WORKING_DIRECTORY "${BUILD_DIR}" OUTPUT_QUIET)
+endforeach()
+
+if(CXX_COMPILER MATCHES "clang")
+  get_filename_component(compiler_dir "${CXX_COMPILER}" DIRECTORY)
+  find_program(LLVM_PROFDATA NAMES llvm-profdata HINTS "${compiler_dir}")
+  if(NOT LLVM_PROFDATA)
+    message(FATAL_ERROR "pgo: llvm-profdata is required for clang builds")
+  endif()
+  file(GLOB raw_profiles "${profile_dir}/*.profraw")
+  run_step("${LLVM_PROFDATA}" merge -o "${profile_dir}/analysis.profdata"
+           ${raw_profiles})
+endif()
+
+message(STATUS "pgo: building optimised binary")
+configure_phase(USE)
+message(STATUS "pgo: wrote ${BUILD_DIR}/analysis")
@@ -0,0 +1,479 @@
+#include "batch.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <glob.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "stage_cache.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// The manifest HASH reads and appends to, one "<hash> <output path>" line per
+// processed input; a later line for the same output wins.
+constexpr const char *MANIFEST_NAME = ".analysis-manifest";
+
+// The masks process_image writes for an input.
+std::vector<std::string> outputs_for(const std::string &output_path,
+                                     size_t region_count) {
+  if (region_count == 0) {
+    return {output_path};
+  }
+  std::vector<std::string> outputs;
+  for (size_t i = 0; i < region_count; ++i) {
+    outputs.push_back(region_output_path(output_path, i));
+  }
+  return outputs;
+}
+
+// Adds a file's bytes to `hasher`, or returns false if it cannot be read.
+bool add_file(ContentHasher &hasher, const std::string &file) {
+  std::ifstream input(file, std::ios::binary);
+  if (!input) {
+    return false;
+  }
+  std::vector<char> chunk(1 << 16);
+  while (input.read(chunk.data(), chunk.size()) || input.gcount() > 0) {
+    hasher.add(chunk.data(), static_cast<size_t>(input.gcount()));
+  }
+  return !input.bad();
+}
+
+// Adds every option that changes the masks written for an input. Timing-only
+// options (threads, blocking, engines, caching) are left out, so changing
+// them does not redo a batch.
+void add_options(ContentHasher &hasher, const PipelineOptions &options,
+                 const std::vector<Rect> &regions) {
+  const StageParameters &p = options.parameters;
+  for (int value : {p.denoise_count, p.denoise_radius, p.blur_count,
+                    p.blur_radius, p.certainty}) {
+    hasher.add_value(value);
+  }
+  hasher.add_value(options.edges);
+  hasher.add_value(options.smoothing);
+  hasher.add_value(options.convolution);
+  for (const Rect &roi : regions) {
+    for (size_t value : {roi.x, roi.y, roi.width, roi.height}) {
+      hasher.add_value(value);
+    }
+  }
+}
+
+// A hash of the input file's bytes.
+std::string file_hash(const std::string &file) {
+  ContentHasher hasher;
+  if (!add_file(hasher, file)) {
+    throw std::runtime_error("unable to read " + file);
+  }
+  return hasher.key().hex();
+}
+
+// A hash of the options add_options covers.
+std::string options_hash(const PipelineOptions &options,
+                         const std::vector<Rect> &regions) {
+  ContentHasher hasher;
+  add_options(hasher, options, regions);
+  return hasher.key().hex();
+}
+
+// A hash of the input file's bytes and of the options add_options covers.
+std::string input_hash(const std::string &file, const PipelineOptions &options,
+                       const std::vector<Rect> &regions) {
+  ContentHasher hasher;
+  if (!add_file(hasher, file)) {
+    throw std::runtime_error("unable to read " + file);
+  }
+  add_options(hasher, options, regions);
+  return hasher.key().hex();
+}
+
+std::unordered_map<std::string, std::string>
+read_manifest(const std::string &path) {
+  std::unordered_map<std::string, std::string> hashes;
+  std::ifstream manifest(path);
+  std::string hash, output;
+  while (manifest >> hash && std::getline(manifest >> std::ws, output)) {
+    hashes[output] = hash;
+  }
+  return hashes;
+}
+
+// A hash of the masks written for an input, or "" if one is missing.
+std::string outputs_hash(const std::vector<std::string> &outputs) {
+  ContentHasher hasher;
+  for (const std::string &output : outputs) {
+    if (!add_file(hasher, output)) {
+      return "";
+    }
+  }
+  return hasher.key().hex();
+}
+
+// The journal's name for an input: its canonical path, so that ./a.ppm and
+// a.ppm, or a path through a symlink, are the same input.
+std::string journal_key(const std::string &input) {
+  return fs::weakly_canonical(input).string();
+}
+
+// One completed input in the journal.
+struct JournalRecord {
+  std::string output_path;
+  // file_hash of the input and options_hash of the run that processed it.
+  std::string input_hash;
+  std::string options_hash;
+  // outputs_hash of the masks it wrote.
+  std::string hash;
+};
+
+// The append-only journal of completed inputs: one tab-separated
+// "input, output path, input hash, options hash, output hash, seconds" line
+// each, keyed by journal_key. Lines are written with a single write() on an
+// O_APPEND descriptor, so each one lands whole or, if the machine goes down
+// mid-write, as a torn last line that the next run ignores.
+class Journal {
+public:
+  Journal(const std::string &path, size_t sync_interval)
+      : path_(path), sync_interval_(sync_interval) {
+    std::ifstream existing(path);
+    std::string line;
+    while (std::getline(existing, line)) {
+      // A line the last run did not finish has no newline.
+      if (existing.eof()) {
+        torn_ = true;
+        break;
+      }
+      std::istringstream fields(line);
+      std::string input;
+      JournalRecord record;
+      if (std::getline(fields, input, '\t') &&
+          std::getline(fields, record.output_path, '\t') &&
+          std::getline(fields, record.input_hash, '\t') &&
+          std::getline(fields, record.options_hash, '\t') &&
+          std::getline(fields, record.hash, '\t')) {
+        records_[journal_key(input)] = record;
+      }
+    }
+
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("unable to open journal " + path + ": " +
+                               std::strerror(errno));
+    }
+    if (torn_) {
+      write("\n");
+    }
+  }
+
+  ~Journal() {
+    if (unsynced_ > 0) {
+      ::fsync(fd_);
+    }
+    ::close(fd_);
+  }
+
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  const JournalRecord *find(const std::string &input) const {
+    auto found = records_.find(journal_key(input));
+    return found == records_.end() ? nullptr : &found->second;
+  }
+
+  size_t size() const { return records_.size(); }
+
+  void append(const std::string &input, const JournalRecord &record,
+              double seconds) {
+    std::string key = journal_key(input);
+    std::ostringstream line;
+    line << key << '\t' << record.output_path << '\t' << record.input_hash
+         << '\t' << record.options_hash << '\t' << record.hash << '\t'
+         << std::fixed << std::setprecision(3) << seconds << '\n';
+    write(line.str());
+    records_[key] = record;
+
+    if (++unsynced_ >= sync_interval_) {
+      if (::fsync(fd_) != 0) {
+        throw std::runtime_error("unable to sync journal " + path_ + ": " +
+                                 std::strerror(errno));
+      }
+      unsynced_ = 0;
+    }
+  }
+
+private:
+  void write(const std::string &text) {
+    ssize_t written = ::write(fd_, text.data(), text.size());
+    if (written != static_cast<ssize_t>(text.size())) {
+      throw std::runtime_error("unable to write journal " + path_);
+    }
+  }
+
+  std::string path_;
+  size_t sync_interval_;
+  int fd_ = -1;
+  size_t unsynced_ = 0;
+  bool torn_ = false;
+  std::unordered_map<std::string, JournalRecord> records_;
+};
+
+} // namespace
+
+std::vector<std::string> read_file_list(const std::string &path) {
+  std::ifstream file;
+  if (path != "-") {
+    file.open(path);
+    if (!file) {
+      throw std::runtime_error("unable to read file list " + path);
+    }
+  }
+  std::istream &list = path == "-" ? std::cin : file;
+
+  std::vector<std::string> files;
+  std::string line;
+  while (std::getline(list, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty() && line[0] != '#') {
+      files.push_back(line);
+    }
+  }
+  return files;
+}
+
+std::vector<std::string> expand_glob(const std::string &pattern) {
+  glob_t matches;
+  int status = ::glob(pattern.c_str(), 0, nullptr, &matches);
+  if (status != 0) {
+    globfree(&matches);
+    throw std::runtime_error(status == GLOB_NOMATCH
+                                 ? "no files match " + pattern
+                                 : "unable to expand " + pattern);
+  }
+  // glob sorts its matches already.
+  std::vector<std::string> files(matches.gl_pathv,
+                                 matches.gl_pathv + matches.gl_pathc);
+  globfree(&matches);
+  return files;
+}
+
+SkipPolicy parse_skip_policy(const std::string &name) {
+  if (name == "never") {
+    return SkipPolicy::NEVER;
+  }
+  if (name == "newer") {
+    return SkipPolicy::NEWER;
+  }
+  if (name == "hash") {
+    return SkipPolicy::HASH;
+  }
+  throw std::invalid_argument("unknown skip policy " + name);
+}
+
+bool set_batch_option(BatchOptions &batch, const std::string &name,
+                      const std::string &value) {
+  if (name == "output-dir") {
+    batch.output_dir = value;
+  } else if (name == "skip") {
+    batch.skip = parse_skip_policy(value);
+  } else if (name == "journal") {
+    batch.journal = value;
+  } else if (name == "journal-sync") {
+    size_t used = 0;
+    long interval = 0;
+    try {
+      interval = std::stol(value, &used);
+    } catch (const std::exception &) {
+      used = 0;
+    }
+    if (used != value.size() || interval < 1) {
+      throw std::invalid_argument(
+          "option journal-sync expects a positive integer, got " + value);
+    }
+    batch.journal_sync = static_cast<size_t>(interval);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string batch_output_path(const std::string &input,
+                              const std::string &output_dir) {
+  fs::path relative;
+  bool leading = true;
+  for (const fs::path &part :
+       fs::path(input).lexically_normal().relative_path()) {
+    if (leading && (part == ".." || part == ".")) {
+      continue;
+    }
+    leading = false;
+    relative /= part;
+  }
+  // The input's extension stays in the name, so a.jpg and a.png do not
+  // share an output.
+  relative += "_mask.png";
+  return (fs::path(output_dir) / relative).string();
+}
+
+BatchSummary run_batch(const std::vector<std::string> &files,
+                       const PipelineOptions &options,
+                       const std::vector<Rect> &regions,
+                       const BatchOptions &batch) {
+  if (batch.skip != SkipPolicy::NEVER && batch.output_dir.empty()) {
+    throw std::invalid_argument("skipping up-to-date inputs needs an output "
+                                "directory");
+  }
+
+  std::string manifest_path =
+      (fs::path(batch.output_dir) / MANIFEST_NAME).string();
+  std::unordered_map<std::string, std::string> manifest;
+  std::ofstream manifest_log;
+  if (batch.skip == SkipPolicy::HASH) {
+    fs::create_directories(batch.output_dir);
+    manifest = read_manifest(manifest_path);
+    manifest_log.open(manifest_path, std::ios::app);
+    if (!manifest_log) {
+      throw std::runtime_error("unable to write " + manifest_path);
+    }
+  }
+
+  std::unique_ptr<Journal> journal;
+  std::string journal_options;
+  if (!batch.journal.empty()) {
+    journal_options = options_hash(options, regions);
+    journal = std::make_unique<Journal>(batch.journal, batch.journal_sync);
+    if (options.verbose && journal->size() > 0) {
+      std::cout << "-journal " << batch.journal << " records "
+                << journal->size() << " completed inputs" << std::endl;
+    }
+  }
+
+  // Every output, checked up front: mirrored names can still collide
+  // (x.png and ../x.png), and one input silently overwriting another's
+  // mask would also leave the manifest calling both up to date.
+  std::vector<std::string> output_paths;
+  std::unordered_map<std::string, const std::string *> writers;
+  for (size_t i = 0; i < files.size(); ++i) {
+    output_paths.push_back(
+        batch.output_dir.empty()
+            ? "output_" + std::to_string(i + 1) + ".png"
+            : batch_output_path(files[i], batch.output_dir));
+    for (const std::string &output :
+         outputs_for(output_paths.back(), regions.size())) {
+      std::string key = fs::path(output).lexically_normal().string();
+      auto written = writers.emplace(key, &files[i]);
+      if (!written.second && *written.first->second != files[i]) {
+        throw std::invalid_argument("inputs " + *written.first->second +
+                                    " and " + files[i] +
+                                    " would both be written to " + output);
+      }
+    }
+  }
+
+  BatchSummary summary;
+  for (size_t i = 0; i < files.size(); ++i) {
+    const std::string &file = files[i];
+    const std::string &output_path = output_paths[i];
+    std::vector<std::string> outputs =
+        outputs_for(output_path, regions.size());
+
+    bool up_to_date = false;
+    std::string hash, journal_input;
+    double seconds = 0;
+    // An input that cannot be read or processed is reported and left out of
+    // the manifest and the journal, so the rest of the batch still runs and
+    // a rerun tries it again.
+    try {
+      bool outputs_exist = true;
+      for (const std::string &output : outputs) {
+        outputs_exist = outputs_exist && fs::exists(output);
+      }
+
+      // Like HASH, the journal only trusts a record made from the same input
+      // bytes and options, and whose masks are still what it wrote. The
+      // input is only read once the cheaper fields match.
+      const JournalRecord *record = journal ? journal->find(file) : nullptr;
+      if (record && record->output_path == output_path &&
+          record->options_hash == journal_options && outputs_exist &&
+          (journal_input = file_hash(file)) == record->input_hash &&
+          outputs_hash(outputs) == record->hash) {
+        up_to_date = true;
+      } else if (batch.skip == SkipPolicy::NEWER && outputs_exist) {
+        fs::file_time_type input_time = fs::last_write_time(file);
+        up_to_date = true;
+        for (const std::string &output : outputs) {
+          up_to_date =
+              up_to_date && fs::last_write_time(output) >= input_time;
+        }
+      } else if (batch.skip == SkipPolicy::HASH) {
+        hash = input_hash(file, options, regions);
+        auto recorded = manifest.find(output_path);
+        up_to_date = outputs_exist && recorded != manifest.end() &&
+                     recorded->second == hash;
+      }
+
+      if (!up_to_date) {
+        fs::path parent = fs::path(output_path).parent_path();
+        if (!parent.empty()) {
+          fs::create_directories(parent);
+        }
+        // Hashed before processing, so the record describes the bytes that
+        // were read, and at most once per input.
+        if (journal && journal_input.empty()) {
+          journal_input = file_hash(file);
+        }
+        auto start = std::chrono::steady_clock::now();
+        process_image(file.c_str(), output_path.c_str(), options, regions);
+        seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+      }
+    } catch (const std::exception &error) {
+      std::cerr << "-failed " << file << ": " << error.what() << std::endl;
+      ++summary.failed;
+      continue;
+    }
+
+    if (up_to_date) {
+      if (options.verbose) {
+        std::cout << "-skipping " << file << ", " << output_path
+                  << " is up to date" << std::endl;
+      }
+      ++summary.skipped;
+      continue;
+    }
+    ++summary.processed;
+
+    if (batch.skip == SkipPolicy::HASH) {
+      manifest_log << hash << " " << output_path << std::endl;
+      manifest[output_path] = hash;
+    }
+    if (journal) {
+      journal->append(file,
+                      {output_path, journal_input, journal_options,
+                       outputs_hash(outputs)},
+                      seconds);
+    }
+  }
+
+  if (options.verbose &&
+      (batch.skip != SkipPolicy::NEVER || journal || summary.failed > 0)) {
+    std::cout << "-batch: " << summary.processed << " processed, "
+              << summary.skipped << " up to date, " << summary.failed
+              << " failed" << std::endl;
+  }
+  return summary;
+}
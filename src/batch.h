@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+// When a batch run treats an input as already done and leaves it alone.
+enum class SkipPolicy {
+  // Every input is processed.
+  NEVER,
+  // Every output exists and is at least as new as the input, as make would
+  // decide. Changed options go unnoticed.
+  NEWER,
+  // Every output exists and the manifest in the output directory records the
+  // same hash of the input bytes and the options that affect the mask.
+  HASH,
+};
+
+// Parses "never", "newer" or "hash".
+SkipPolicy parse_skip_policy(const std::string &name);
+
+struct BatchOptions {
+  // Directory masks are written to, named after their inputs (see
+  // batch_output_path). Empty keeps the CLI's positional output_<i>.png names
+  // in the working directory.
+  std::string output_dir;
+  // Which inputs to skip on a rerun; anything but NEVER needs an output
+  // directory, since positional names change with the argument list.
+  SkipPolicy skip = SkipPolicy::NEVER;
+  // Append-only record of completed inputs; empty for none. A rerun with the
+  // same journal resumes where the last one stopped: inputs recorded with
+  // the same output path, input bytes and mask-affecting options (as HASH
+  // compares them), whose outputs still have the recorded hash, are skipped.
+  // Inputs are recorded by canonical path, so ./a.ppm and a.ppm match.
+  std::string journal;
+  // Completed inputs between fsyncs of the journal. Records are written
+  // unbuffered, so a killed process loses none of them; only losing the
+  // machine can cost the up to `journal_sync` unsynced ones, which are then
+  // redone.
+  size_t journal_sync = 8;
+};
+
+// Sets a batch option by its CLI name (output-dir, skip, journal,
+// journal-sync) and returns true, or returns false for any other name. Throws
+// std::invalid_argument for a malformed value.
+bool set_batch_option(BatchOptions &batch, const std::string &name,
+                      const std::string &value);
+
+// Reads the inputs listed in a file, one path per line; blank lines and
+// lines starting with '#' are ignored and "-" reads standard input. Throws
+// std::runtime_error if the file cannot be read.
+std::vector<std::string> read_file_list(const std::string &path);
+
+// The paths matching a shell wildcard pattern such as "scans/*.png", sorted.
+// Throws std::runtime_error if nothing matches.
+std::vector<std::string> expand_glob(const std::string &pattern);
+
+// The mask file for `input` in `output_dir`: the input path with "_mask.png"
+// appended, mirrored under the directory, e.g. scans/a.jpg ->
+// out/scans/a.jpg_mask.png. Root and leading ".." components are dropped so
+// that every output stays inside `output_dir`, which means different inputs
+// can map to the same name; run_batch rejects such batches.
+std::string batch_output_path(const std::string &input,
+                              const std::string &output_dir);
+
+// What a batch run did.
+struct BatchSummary {
+  size_t processed = 0;
+  size_t skipped = 0;
+  // Inputs that could not be read or processed; each is reported on
+  // standard error.
+  size_t failed = 0;
+};
+
+// Runs process_image on every file in turn, creating the output directories
+// it needs and skipping inputs that `batch.journal` records as done or
+// `batch.skip` finds up to date. The manifest and the journal are appended to
+// once an input's masks are written, so an interrupted batch redoes at most
+// the input it was on.
+// An input that fails, e.g. because it cannot be read or its ROI has no
+// pixels to pick a threshold from, is reported and counted in `failed`, and
+// the batch goes on with the next one.
+// Throws std::invalid_argument, before processing anything, for a skip
+// policy without an output directory or for two inputs that would write the
+// same output, and std::runtime_error if the manifest or journal cannot be
+// written.
+BatchSummary run_batch(const std::vector<std::string> &files,
+                       const PipelineOptions &options,
+                       const std::vector<Rect> &regions,
+                       const BatchOptions &batch);
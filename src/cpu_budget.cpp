@@ -0,0 +1,150 @@
+#include "cpu_budget.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// The CPUs in the affinity mask, or none if it cannot be read. The mask is
+// sized dynamically, since machines can have more than CPU_SETSIZE CPUs.
+std::vector<int> read_affinity() {
+  std::vector<int> cpus;
+  for (size_t max_cpus = 1024; max_cpus <= (1 << 16); max_cpus *= 2) {
+    cpu_set_t *set = CPU_ALLOC(max_cpus);
+    if (!set) {
+      return cpus;
+    }
+    size_t size = CPU_ALLOC_SIZE(max_cpus);
+    CPU_ZERO_S(size, set);
+    if (sched_getaffinity(0, size, set) == 0) {
+      for (size_t cpu = 0; cpu < max_cpus; ++cpu) {
+        if (CPU_ISSET_S(cpu, size, set)) {
+          cpus.push_back(static_cast<int>(cpu));
+        }
+      }
+      CPU_FREE(set);
+      return cpus;
+    }
+    CPU_FREE(set);
+    if (errno != EINVAL) {
+      return cpus;
+    }
+  }
+  return cpus;
+}
+
+// CPUs allowed by a quota of `quota` per `period` microseconds, rounded up,
+// or 0 for no limit.
+size_t quota_cpus(long long quota, long long period) {
+  if (quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return static_cast<size_t>((quota + period - 1) / period);
+}
+
+// The smaller of two limits where 0 means unlimited.
+size_t min_limit(size_t a, size_t b) {
+  if (a == 0) {
+    return b;
+  }
+  return b == 0 ? a : std::min(a, b);
+}
+
+// Reads "<quota> <period>" or "max <period>" from a cgroup v2 cpu.max.
+size_t cgroup2_cpus(const std::string &directory) {
+  std::ifstream file(directory + "/cpu.max");
+  std::string quota;
+  long long period = 0;
+  if (!(file >> quota >> period) || quota == "max") {
+    return 0;
+  }
+  try {
+    return quota_cpus(std::stoll(quota), period);
+  } catch (const std::exception &) {
+    return 0;
+  }
+}
+
+// Reads cpu.cfs_quota_us (-1 when unlimited) and cpu.cfs_period_us.
+size_t cgroup1_cpus(const std::string &directory) {
+  std::ifstream quota_file(directory + "/cpu.cfs_quota_us");
+  std::ifstream period_file(directory + "/cpu.cfs_period_us");
+  long long quota = 0, period = 0;
+  if (!(quota_file >> quota) || !(period_file >> period)) {
+    return 0;
+  }
+  return quota_cpus(quota, period);
+}
+
+// The quota of the process's cgroups. /proc/self/cgroup lists
+// "<id>:<controllers>:<path>", with id 0 and no controllers for cgroup v2.
+// Inside a cgroup namespace the path is "/" and the limit sits on the
+// namespace root, so the mount point itself is checked as well.
+size_t cgroup_cpus() {
+  std::ifstream cgroups("/proc/self/cgroup");
+  size_t limit = 0;
+  std::string line;
+  while (std::getline(cgroups, line)) {
+    size_t first = line.find(':'), second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      continue;
+    }
+    std::string controllers = line.substr(first + 1, second - first - 1);
+    std::string path = line.substr(second + 1);
+
+    if (line.compare(0, first, "0") == 0 && controllers.empty()) {
+      // Every ancestor's cpu.max applies too.
+      std::string directory = "/sys/fs/cgroup" + path;
+      while (true) {
+        limit = min_limit(limit, cgroup2_cpus(directory));
+        size_t slash = directory.find_last_of('/');
+        if (directory == "/sys/fs/cgroup" || slash == std::string::npos) {
+          break;
+        }
+        directory.erase(slash);
+      }
+      continue;
+    }
+
+    std::stringstream list(controllers);
+    std::string controller;
+    while (std::getline(list, controller, ',')) {
+      if (controller != "cpu") {
+        continue;
+      }
+      for (const char *mount :
+           {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+        limit = min_limit(limit, cgroup1_cpus(mount + path));
+        limit = min_limit(limit, cgroup1_cpus(mount));
+      }
+    }
+  }
+  return limit;
+}
+
+} // namespace
+
+size_t detect_cpu_budget() {
+  size_t budget = min_limit(read_affinity().size(), cgroup_cpus());
+  if (budget == 0) {
+    budget = std::thread::hardware_concurrency();
+  }
+  return std::max<size_t>(budget, 1);
+}
+
+size_t cpu_budget() {
+  static const size_t budget = detect_cpu_budget();
+  return budget;
+}
+
+const std::vector<int> &affinity_cpus() {
+  static const std::vector<int> cpus = read_affinity();
+  return cpus;
+}
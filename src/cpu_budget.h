@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Number of CPUs this process may actually run on: the smallest of the
+// sched_getaffinity mask, the cgroup v2 cpu.max quota (of the process's
+// cgroup and its ancestors) and the cgroup v1 cfs quota, with quotas rounded
+// up. Falls back to std::thread::hardware_concurrency() when none of these
+// can be read, and is never less than 1.
+size_t detect_cpu_budget();
+
+// detect_cpu_budget(), computed once per process.
+size_t cpu_budget();
+
+// The CPUs in the process's affinity mask at startup, in ascending order.
+// Empty if the mask cannot be read.
+const std::vector<int> &affinity_cpus();
@@ -0,0 +1,425 @@
+#include "dialate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "numa.h"
+#include "parallel.h"
+
+namespace {
+
+using Mask = ImageBuffer<unsigned char>;
+
+// The dialate window along an axis and the set counts that decide a pixel.
+// With a FixedRadius the bounds fold to constants.
+template <typename Radius> struct DialateWindow {
+  Radius radius;
+  // The fewest set pixels a (possibly edge-clipped) window of each area needs
+  // for dialate_operator's mean to exceed 127, i.e. 255 * set > 127 * area.
+  // The float mean agrees exactly: with r <= MAX_DENOISE_RADIUS the sum is
+  // an integer below 2^24, and a mean above 127 is at least 1 / area above
+  // it, far more than its rounding. The bound also keeps dialate_pixel's
+  // unsigned byte sums and sweep_pass's 16-bit column counts from wrapping.
+  std::vector<unsigned> min_set;
+
+  explicit DialateWindow(Radius radius) : radius(radius) {
+    size_t edge = 2 * r() + 1;
+    min_set.resize(edge * edge + 1);
+    for (size_t area = 0; area < min_set.size(); ++area) {
+      min_set[area] = static_cast<unsigned>(127 * area / 255 + 1);
+    }
+  }
+
+  size_t r() const { return static_cast<int>(radius); }
+
+  // Bounds [start, end) of the window around `v` along an axis of `size`.
+  size_t start(size_t v) const { return v > r() ? v - r() : 0; }
+  size_t end(size_t v, size_t size) const {
+    return std::min<size_t>(v + r() + 1, size);
+  }
+
+  // How many occupancy tiles away a change can reach: the frontier engine
+  // dirties this ring of tiles around each tile that changed.
+  size_t ring() const { return (r() + OCCUPANCY_TILE - 1) / OCCUPANCY_TILE; }
+};
+
+// One dialate pass and re-binarisation of the pixel at (x, y), counting its
+// window directly.
+template <typename Radius>
+unsigned char dialate_pixel(const Mask &mask, size_t x, size_t y,
+                            const DialateWindow<Radius> &window) {
+  if (mask.row(y)[x] == 0) {
+    return 0;
+  }
+  // Summing the 0/255 bytes themselves vectorises better than counting.
+  unsigned sum = 0;
+  size_t r = window.r(), edge = 2 * r + 1;
+  if (x >= r && y >= r && x + r < mask.width() && y + r < mask.height()) {
+    // A whole window: constant bounds.
+    for (size_t wy = y - r; wy <= y + r; ++wy) {
+      const unsigned char *row = mask.row(wy) + (x - r);
+      for (size_t i = 0; i < edge; ++i) {
+        sum += row[i];
+      }
+    }
+    return sum / 255 >= window.min_set[edge * edge] ? 255 : 0;
+  }
+
+  size_t x_start = window.start(x), x_end = window.end(x, mask.width());
+  size_t y_start = window.start(y), y_end = window.end(y, mask.height());
+  for (size_t wy = y_start; wy < y_end; ++wy) {
+    const unsigned char *row = mask.row(wy);
+    for (size_t wx = x_start; wx < x_end; ++wx) {
+      sum += row[wx];
+    }
+  }
+  return sum / 255 >= window.min_set[(x_end - x_start) * (y_end - y_start)]
+             ? 255
+             : 0;
+}
+
+// One dialate pass over `area` from `source` into `target`, returning how
+// many pixels changed. Each row band keeps a count of set pixels per column
+// over the current window rows, updated by the rows entering and leaving as
+// it moves down, and each row slides a window sum along those counts, so a
+// pixel costs a handful of byte operations instead of a full window.
+template <typename Radius>
+size_t sweep_pass(const Mask &source, Mask &target, const Rect &area,
+                  const DialateWindow<Radius> &window) {
+  size_t width = source.width(), height = source.height();
+  size_t columns_start = window.start(area.x);
+  size_t columns_end = window.end(area.x + area.width - 1, width);
+
+  // Each call primes its column counts with a full window of rows, so the
+  // rows are handed out in runs of several windows to keep that cost small
+  // next to the sliding updates.
+  size_t min_rows = 4 * (2 * window.r() + 1);
+  std::atomic<size_t> changed(0);
+  parallel_for(area.height, min_rows, [&](size_t begin, size_t end) {
+    std::vector<unsigned short> columns(columns_end - columns_start);
+    auto add_row = [&](size_t y, int sign) {
+      const unsigned char *row = source.row(y) + columns_start;
+      for (size_t c = 0; c < columns.size(); ++c) {
+        columns[c] += sign * (row[c] != 0);
+      }
+    };
+
+    size_t first = area.y + begin;
+    size_t rows_start = window.start(first);
+    size_t rows_end = window.end(first, height);
+    for (size_t y = rows_start; y < rows_end; ++y) {
+      add_row(y, 1);
+    }
+
+    size_t thread_changed = 0;
+    for (size_t y = first; y < area.y + end; ++y) {
+      for (; rows_start < window.start(y); ++rows_start) {
+        add_row(rows_start, -1);
+      }
+      for (; rows_end < window.end(y, height); ++rows_end) {
+        add_row(rows_end, 1);
+      }
+      size_t rows = rows_end - rows_start;
+
+      const unsigned char *in = source.row(y);
+      unsigned char *out = target.row(y);
+      size_t x_start = window.start(area.x), x_end = window.end(area.x, width);
+      size_t set = 0;
+      for (size_t c = x_start; c < x_end; ++c) {
+        set += columns[c - columns_start];
+      }
+      for (size_t x = area.x; x < area.x + area.width; ++x) {
+        for (; x_start < window.start(x); ++x_start) {
+          set -= columns[x_start - columns_start];
+        }
+        for (; x_end < window.end(x, width); ++x_end) {
+          set += columns[x_end - columns_start];
+        }
+        unsigned char value =
+            in[x] != 0 && set >= window.min_set[(x_end - x_start) * rows]
+                ? 255
+                : 0;
+        thread_changed += value != in[x];
+        out[x] = value;
+      }
+    }
+    changed += thread_changed;
+  });
+  return changed;
+}
+
+// Up to `count` full passes over the shrinking area the remaining passes
+// still need, ping-ponging between `pixels` and `next`, until one changes
+// nothing.
+template <typename Radius>
+int dialate_sweep(Mask &pixels, const Rect &region, int count,
+                  const DialateWindow<Radius> &window) {
+  size_t width = pixels.width(), height = pixels.height();
+  Mask next(width, height);
+  for (int pass = 0; pass < count; ++pass) {
+    Rect needed = expand_rect(region, (count - 1 - pass) * window.r(),
+                              width, height);
+    size_t changed = sweep_pass(pixels, next, needed, window);
+    std::swap(pixels, next);
+    if (changed == 0) {
+      return pass + 1;
+    }
+  }
+  return count;
+}
+
+// A pixel whose value changed in a pass, as an offset into the buffer.
+struct PixelChange {
+  size_t offset;
+  unsigned char value;
+};
+
+// Re-summarises tile `t` of `occupancy` from the current mask.
+void update_tile(OccupancyMap &occupancy, size_t t, const Mask &pixels) {
+  Rect tile = occupancy.tile_rect(t);
+  size_t set = 0;
+  for (size_t y = tile.y; y < tile.y + tile.height; ++y) {
+    const unsigned char *row = pixels.row(y);
+    for (size_t x = tile.x; x < tile.x + tile.width; ++x) {
+      set += row[x] != 0;
+    }
+  }
+  occupancy.tiles[t] = classify_tile(set, tile.area());
+}
+
+// Whether no pixel of tile `t` can change in the next pass: it is empty, or
+// it and every tile its windows reach (`ring` tiles around) are full.
+bool tile_is_stable(const OccupancyMap &occupancy, size_t t, size_t ring) {
+  TileOccupancy state = occupancy.tiles[t];
+  if (state != TileOccupancy::FULL) {
+    return state == TileOccupancy::EMPTY;
+  }
+  size_t tiles_x = occupancy.tiles_x, tiles_y = occupancy.tiles_y;
+  size_t tx = t % tiles_x, ty = t / tiles_x;
+  size_t ty_end = std::min(ty + ring + 1, tiles_y);
+  size_t tx_end = std::min(tx + ring + 1, tiles_x);
+  for (size_t ny = ty > ring ? ty - ring : 0; ny < ty_end; ++ny) {
+    for (size_t nx = tx > ring ? tx - ring : 0; nx < tx_end; ++nx) {
+      if (occupancy.tiles[ny * tiles_x + nx] != TileOccupancy::FULL) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Incremental dialate. Each pass computes the new values of the dirty tiles
+// from the current mask and only collects the pixels that change; once every
+// thread is done the changes are applied in place, which keeps the Jacobi
+// semantics of the full sweep without a second buffer. A pixel whose window
+// saw no change in the previous pass would recompute its previous value, so
+// only tiles within the window's ring of a changed tile are visited next
+// time.
+// Tiles the occupancy map shows to be stable are skipped outright, and the
+// map is kept current by re-summarising every tile that changed.
+template <typename Radius>
+int dialate_frontier(Mask &pixels, const Rect &region, OccupancyMap occupancy,
+                     int count, const DialateWindow<Radius> &window) {
+  size_t width = pixels.width(), height = pixels.height();
+  size_t tiles_x = occupancy.tiles_x, tiles_y = occupancy.tiles_y;
+  size_t ring = window.ring();
+
+  std::vector<size_t> dirty;
+  for (size_t t = 0; t < occupancy.tiles.size(); ++t) {
+    if (!tile_is_stable(occupancy, t, ring)) {
+      dirty.push_back(t);
+    }
+  }
+  std::vector<unsigned char> next_dirty(tiles_x * tiles_y);
+
+  for (int pass = 0; pass < count; ++pass) {
+    Rect needed = expand_rect(region, (count - 1 - pass) * window.r(),
+                              width, height);
+
+    std::vector<std::vector<PixelChange>> changes;
+    std::vector<std::vector<size_t>> touched;
+    std::mutex merge;
+
+    parallel_for(dirty.size(), [&](size_t begin, size_t end) {
+      std::vector<PixelChange> thread_changes;
+      std::vector<size_t> thread_touched;
+
+      for (size_t i = begin; i < end; ++i) {
+        size_t t = dirty[i];
+        Rect tile = occupancy.tile_rect(t);
+        size_t x_start = std::max(tile.x, needed.x);
+        size_t y_start = std::max(tile.y, needed.y);
+        size_t x_end =
+            std::min(tile.x + tile.width, needed.x + needed.width);
+        size_t y_end =
+            std::min(tile.y + tile.height, needed.y + needed.height);
+
+        bool tile_changed = false;
+        for (size_t y = y_start; y < y_end; ++y) {
+          const unsigned char *row = pixels.row(y);
+          for (size_t x = x_start; x < x_end; ++x) {
+            unsigned char value = dialate_pixel(pixels, x, y, window);
+            if (value != row[x]) {
+              thread_changes.push_back({y * pixels.stride() + x, value});
+              tile_changed = true;
+            }
+          }
+        }
+        if (tile_changed) {
+          thread_touched.push_back(t);
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(merge);
+      changes.push_back(std::move(thread_changes));
+      touched.push_back(std::move(thread_touched));
+    });
+
+    bool any_change = false;
+    for (const std::vector<PixelChange> &list : changes) {
+      for (const PixelChange &change : list) {
+        pixels.data()[change.offset] = change.value;
+        any_change = true;
+      }
+    }
+    if (!any_change) {
+      return pass + 1;
+    }
+
+    for (const std::vector<size_t> &list : touched) {
+      for (size_t t : list) {
+        update_tile(occupancy, t, pixels);
+      }
+    }
+
+    // Dirty the ring of tiles around every tile that changed.
+    std::fill(next_dirty.begin(), next_dirty.end(), 0);
+    for (const std::vector<size_t> &list : touched) {
+      for (size_t t : list) {
+        size_t tx = t % tiles_x, ty = t / tiles_x;
+        size_t ty_end = std::min(ty + ring + 1, tiles_y);
+        size_t tx_end = std::min(tx + ring + 1, tiles_x);
+        for (size_t ny = ty > ring ? ty - ring : 0; ny < ty_end; ++ny) {
+          for (size_t nx = tx > ring ? tx - ring : 0; nx < tx_end; ++nx) {
+            next_dirty[ny * tiles_x + nx] = 1;
+          }
+        }
+      }
+    }
+    dirty.clear();
+    for (size_t t = 0; t < next_dirty.size(); ++t) {
+      if (next_dirty[t] && !tile_is_stable(occupancy, t, ring)) {
+        dirty.push_back(t);
+      }
+    }
+  }
+
+  return count;
+}
+
+} // namespace
+
+Rect OccupancyMap::tile_rect(size_t t) const {
+  size_t x = region.x + (t % tiles_x) * OCCUPANCY_TILE;
+  size_t y = region.y + (t / tiles_x) * OCCUPANCY_TILE;
+  return Rect{x, y, std::min(OCCUPANCY_TILE, region.x + region.width - x),
+              std::min(OCCUPANCY_TILE, region.y + region.height - y)};
+}
+
+OccupancyMap make_occupancy(const Rect &region) {
+  OccupancyMap occupancy;
+  occupancy.region = region;
+  occupancy.tiles_x = (region.width + OCCUPANCY_TILE - 1) / OCCUPANCY_TILE;
+  occupancy.tiles_y = (region.height + OCCUPANCY_TILE - 1) / OCCUPANCY_TILE;
+  occupancy.tiles.assign(occupancy.tiles_x * occupancy.tiles_y,
+                         TileOccupancy::MIXED);
+  return occupancy;
+}
+
+TileOccupancy classify_tile(size_t set, size_t area) {
+  if (set == 0) {
+    return TileOccupancy::EMPTY;
+  }
+  return set == area ? TileOccupancy::FULL : TileOccupancy::MIXED;
+}
+
+OccupancyMap summarise_occupancy(ImageView<const unsigned char> mask,
+                                 const Rect &region) {
+  OccupancyMap occupancy = make_occupancy(region);
+  for (size_t t = 0; t < occupancy.tiles.size(); ++t) {
+    Rect tile = occupancy.tile_rect(t);
+    size_t set = 0;
+    for (size_t y = tile.y; y < tile.y + tile.height; ++y) {
+      const unsigned char *row = mask.row(y);
+      for (size_t x = tile.x; x < tile.x + tile.width; ++x) {
+        set += row[x] != 0;
+      }
+    }
+    occupancy.tiles[t] = classify_tile(set, tile.area());
+  }
+  return occupancy;
+}
+
+DialateEngine parse_dialate_engine(const std::string &name) {
+  if (name == "sweep") {
+    return DialateEngine::SWEEP;
+  }
+  if (name == "frontier") {
+    return DialateEngine::FRONTIER;
+  }
+  throw std::invalid_argument("unknown dialate engine " + name);
+}
+
+int dialate(ImageView<const unsigned char> input,
+            ImageView<unsigned char> output, const DialateOptions &options) {
+  return dialate(input, Rect{0, 0, input.width, input.height}, output,
+                 options);
+}
+
+int dialate(ImageView<const unsigned char> input, const Rect &region,
+            ImageView<unsigned char> output, const DialateOptions &options) {
+  if (options.count < 1 || options.radius < 1 ||
+      options.radius > MAX_DENOISE_RADIUS) {
+    throw std::invalid_argument("dialate count or radius out of range");
+  }
+  size_t width = input.width, height = input.height;
+
+  // The copy below is serial, so place the pages first: by row band for
+  // the row-parallel sweep, spread out for the frontier's scattered tiles.
+  Mask pixels(width, height);
+  if (options.engine == DialateEngine::FRONTIER) {
+    interleave_pages(pixels);
+  } else {
+    first_touch(pixels);
+  }
+  Rect needed = expand_rect(region, options.count * options.radius, width,
+                            height);
+  for (size_t y = needed.y; y < needed.y + needed.height; ++y) {
+    const unsigned char *row = input.row(y);
+    std::copy(row + needed.x, row + needed.x + needed.width,
+              pixels.row(y) + needed.x);
+  }
+
+  int passes = with_radius(options.radius, [&](auto radius) {
+    DialateWindow<decltype(radius)> window(radius);
+    if (options.engine != DialateEngine::FRONTIER) {
+      return dialate_sweep(pixels, region, options.count, window);
+    }
+    if (options.occupancy && options.occupancy->region == needed) {
+      return dialate_frontier(pixels, region, *options.occupancy,
+                              options.count, window);
+    }
+    return dialate_frontier(pixels, region, summarise_occupancy(input, needed),
+                            options.count, window);
+  });
+
+  for (size_t y = 0; y < region.height; ++y) {
+    const unsigned char *row = pixels.row(region.y + y) + region.x;
+    std::copy(row, row + region.width, output.row(y));
+  }
+  return passes;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "image_buffer.h"
+#include "operators.h"
+
+// How the dialate passes are scheduled. Both engines give identical masks.
+enum class DialateEngine {
+  // Every pass recomputes the whole (remaining) region, with window counts
+  // slid along rows and columns so a pixel costs O(1) rather than O(window).
+  SWEEP,
+  // After the first pass, only tiles within the radius of a pixel that
+  // changed in the previous pass are recomputed, so the work scales with the
+  // part of the mask that is still changing.
+  FRONTIER,
+};
+
+// Parses "sweep" or "frontier".
+DialateEngine parse_dialate_engine(const std::string &name);
+
+// Edge length of the tiles an OccupancyMap summarises. With the default
+// radius, a tile's dialate windows only reach into the tiles directly around
+// it; larger radii reach further rings of tiles.
+constexpr size_t OCCUPANCY_TILE = 32;
+
+enum class TileOccupancy : unsigned char { EMPTY, FULL, MIXED };
+
+// Per-tile summary of a binary mask over `region`, tiled from its top-left
+// corner. Dialate never sets a pixel, so an EMPTY tile stays empty, and a
+// FULL tile whose neighbouring tiles are all FULL stays full; the frontier
+// engine skips both.
+struct OccupancyMap {
+  Rect region;
+  size_t tiles_x = 0;
+  size_t tiles_y = 0;
+  std::vector<TileOccupancy> tiles;
+
+  // Pixel bounds of tile `t`, clipped to `region`.
+  Rect tile_rect(size_t t) const;
+};
+
+// An all-MIXED map covering `region`.
+OccupancyMap make_occupancy(const Rect &region);
+
+// Classifies a tile from the number of its pixels that are set.
+TileOccupancy classify_tile(size_t set, size_t area);
+
+// Summarises the 0/255 `mask` over `region`.
+OccupancyMap summarise_occupancy(ImageView<const unsigned char> mask,
+                                 const Rect &region);
+
+struct DialateOptions {
+  DialateEngine engine = DialateEngine::SWEEP;
+  // The most passes to run and their window radius
+  // (StageParameters::denoise_count and denoise_radius).
+  int count = StageParameters().denoise_count;
+  int radius = StageParameters().denoise_radius;
+  // Summary of the input mask over the dialated area (the region grown by
+  // count * radius), e.g. from apply_threshold. The frontier
+  // engine summarises the mask itself if this is null or covers a different
+  // area; the sweep engine ignores it.
+  const OccupancyMap *occupancy = nullptr;
+};
+
+// Runs up to `count` dialate passes over a 0/255 mask, re-binarising
+// the result after each one and stopping early once the mask no longer
+// changes. The passes stay in 8 bits: a pixel's window is reduced to a count
+// of set pixels and compared with the smallest count whose dialate_operator
+// mean exceeds 127 for that window area, which gives exactly the float
+// result. `output` may alias `input`. Returns the number of passes run.
+// Throws std::invalid_argument unless the count is positive and the radius
+// is in [1, MAX_DENOISE_RADIUS].
+int dialate(ImageView<const unsigned char> input,
+            ImageView<unsigned char> output,
+            const DialateOptions &options = {});
+
+// Dialates only the pixels of `input` inside `region`, writing them to
+// `output` (which is region-sized). Each pass computes the shrinking area the
+// remaining passes still need, so `input` must be valid within
+// count * radius of `region` (or up to the image edge).
+int dialate(ImageView<const unsigned char> input, const Rect &region,
+            ImageView<unsigned char> output,
+            const DialateOptions &options = {});
@@ -0,0 +1,143 @@
+#include "fft.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+constexpr double PI = 3.14159265358979323846;
+
+// a * b, written out: std::complex's operator* guards against infinities and
+// NaNs with a library call unless -ffast-math is on.
+inline std::complex<float> multiply(std::complex<float> a,
+                                    std::complex<float> b) {
+  return {a.real() * b.real() - a.imag() * b.imag(),
+          a.real() * b.imag() + a.imag() * b.real()};
+}
+
+} // namespace
+
+Fft::Fft(size_t size) : size_(size) {
+  if (size < 2 || (size & (size - 1)) != 0) {
+    throw std::invalid_argument("FFT size must be a power of two");
+  }
+
+  size_t bits = 0;
+  while ((size_t(1) << bits) < size) {
+    ++bits;
+  }
+  for (size_t i = 0; i < size; ++i) {
+    size_t reversed = 0;
+    for (size_t b = 0; b < bits; ++b) {
+      reversed |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    if (i < reversed) {
+      swaps_.emplace_back(i, reversed);
+    }
+  }
+
+  twiddles_.resize(size / 2);
+  for (size_t k = 0; k < size / 2; ++k) {
+    double angle = -2.0 * PI * k / size;
+    twiddles_[k] = {static_cast<float>(std::cos(angle)),
+                    static_cast<float>(std::sin(angle))};
+  }
+}
+
+void Fft::forward(std::complex<float> *data) const { transform(data, false); }
+
+void Fft::inverse(std::complex<float> *data) const {
+  transform(data, true);
+  float scale = 1.0f / size_;
+  for (size_t i = 0; i < size_; ++i) {
+    data[i] *= scale;
+  }
+}
+
+// Iterative decimation in time: bit-reverse, then log2(size) stages of
+// butterflies over spans doubling from 2 to size.
+void Fft::transform(std::complex<float> *data, bool inverse) const {
+  for (const auto &swap : swaps_) {
+    std::swap(data[swap.first], data[swap.second]);
+  }
+
+  for (size_t span = 2; span <= size_; span *= 2) {
+    size_t half = span / 2, step = size_ / span;
+    for (size_t start = 0; start < size_; start += span) {
+      std::complex<float> *low = data + start, *high = low + half;
+      for (size_t j = 0; j < half; ++j) {
+        std::complex<float> w = twiddles_[j * step];
+        if (inverse) {
+          w = std::conj(w);
+        }
+        std::complex<float> t = multiply(high[j], w);
+        high[j] = low[j] - t;
+        low[j] += t;
+      }
+    }
+  }
+}
+
+FftConvolver::FftConvolver(const std::vector<float> &kernel, size_t fft_size)
+    : fft_(fft_size), taps_(kernel.size()) {
+  if (taps_ % 2 == 0 || fft_size < 2 * taps_) {
+    throw std::invalid_argument("FFT too small for the kernel");
+  }
+
+  // Reversed, so that the transform's convolution is the correlation the
+  // interface promises.
+  spectrum_.assign(fft_size, 0.0f);
+  for (size_t j = 0; j < taps_; ++j) {
+    spectrum_[j] = kernel[taps_ - 1 - j];
+  }
+  fft_.forward(spectrum_.data());
+}
+
+size_t FftConvolver::default_fft_size(size_t taps) {
+  // Four times the kernel keeps the wasted tail of each block to a quarter
+  // of the transform without making the transforms themselves slow.
+  size_t size = 2;
+  while (size < 4 * taps) {
+    size *= 2;
+  }
+  return size;
+}
+
+void FftConvolver::convolve(const float *a, const float *b, size_t length,
+                            float *out_a, float *out_b,
+                            std::vector<std::complex<float>> &work) const {
+  size_t n = fft_.size(), radius = (taps_ - 1) / 2;
+
+  // The full convolution has length + taps - 1 samples; out[i] is sample
+  // i + radius of it.
+  work.assign(n + length + taps_ - 1, 0.0f);
+  std::complex<float> *buffer = work.data(), *full = buffer + n;
+
+  for (size_t start = 0; start < length; start += block()) {
+    size_t count = std::min(block(), length - start);
+    for (size_t i = 0; i < count; ++i) {
+      buffer[i] = {a[start + i], b ? b[start + i] : 0.0f};
+    }
+    std::fill(buffer + count, buffer + n, 0.0f);
+
+    fft_.forward(buffer);
+    for (size_t k = 0; k < n; ++k) {
+      buffer[k] = multiply(buffer[k], spectrum_[k]);
+    }
+    fft_.inverse(buffer);
+
+    for (size_t i = 0; i < count + taps_ - 1; ++i) {
+      full[start + i] += buffer[i];
+    }
+  }
+
+  for (size_t i = 0; i < length; ++i) {
+    out_a[i] = full[i + radius].real();
+  }
+  if (b) {
+    for (size_t i = 0; i < length; ++i) {
+      out_b[i] = full[i + radius].imag();
+    }
+  }
+}
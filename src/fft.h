@@ -0,0 +1,62 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+// An in-place radix-2 complex FFT of a fixed power-of-two size. Written out
+// here, rather than taken from a library, so the build needs nothing beyond
+// the compiler; it only has to be fast enough for the convolution below.
+class Fft {
+public:
+  // `size` must be a power of two.
+  explicit Fft(size_t size);
+
+  size_t size() const { return size_; }
+
+  // Unscaled forward transform, X[k] = sum x[n] exp(-2 pi i k n / size).
+  void forward(std::complex<float> *data) const;
+  // The inverse of forward, scaled by 1 / size.
+  void inverse(std::complex<float> *data) const;
+
+private:
+  void transform(std::complex<float> *data, bool inverse) const;
+
+  size_t size_;
+  // Index pairs swapped by the bit-reversal permutation.
+  std::vector<std::pair<size_t, size_t>> swaps_;
+  // exp(-2 pi i k / size) for k < size / 2.
+  std::vector<std::complex<float>> twiddles_;
+};
+
+// Convolves lines of real samples with a fixed odd-length kernel by tiled
+// overlap-add: each line is cut into blocks of block() samples, every block
+// is transformed, multiplied by the kernel's spectrum and transformed back,
+// and the overlapping tails are summed. Lines are real, so two are packed
+// into one complex transform (as its real and imaginary parts) and come back
+// separated the same way.
+class FftConvolver {
+public:
+  // Uses transforms of `fft_size` points, which must be a power of two of at
+  // least twice the kernel length.
+  FftConvolver(const std::vector<float> &kernel, size_t fft_size);
+
+  // The FFT size the cost model would pick for a kernel of `taps` taps.
+  static size_t default_fft_size(size_t taps);
+
+  size_t fft_size() const { return fft_.size(); }
+  // Input samples per block.
+  size_t block() const { return fft_.size() - taps_ + 1; }
+
+  // Computes out[i] = sum_j kernel[j] * in[i + j - radius] for i < length,
+  // where radius = (taps - 1) / 2 and samples outside the line are zero,
+  // for `a` into `out_a` and, if `b` is not null, `b` into `out_b`.
+  // `work` is per-thread scratch.
+  void convolve(const float *a, const float *b, size_t length, float *out_a,
+                float *out_b, std::vector<std::complex<float>> &work) const;
+
+private:
+  Fft fft_;
+  size_t taps_;
+  std::vector<std::complex<float>> spectrum_;
+};
@@ -0,0 +1,128 @@
+#include "image_analysis.h"
+
+#include <exception>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "pipeline.h"
+
+struct ia_pipeline {
+  PipelineOptions options;
+  std::map<std::string, double> metrics;
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+ia_status fail(ia_status status, const std::string &message) {
+  last_error = message;
+  return status;
+}
+
+// Converts any exception escaping the pipeline into a status code; nothing
+// may propagate across the C boundary.
+template <typename Body> ia_status guarded(Body body) {
+  try {
+    body();
+    return IA_OK;
+  } catch (const std::invalid_argument &error) {
+    return fail(IA_INVALID_ARGUMENT, error.what());
+  } catch (const std::exception &error) {
+    return fail(IA_FAILED, error.what());
+  } catch (...) {
+    return fail(IA_FAILED, "unknown error");
+  }
+}
+
+} // namespace
+
+extern "C" {
+
+int ia_api_version(void) { return IA_API_VERSION; }
+
+ia_pipeline *ia_pipeline_create(void) {
+  ia_pipeline *pipeline = new (std::nothrow) ia_pipeline();
+  if (!pipeline) {
+    last_error = "out of memory";
+    return nullptr;
+  }
+  pipeline->options.verbose = false;
+  return pipeline;
+}
+
+void ia_pipeline_destroy(ia_pipeline *pipeline) { delete pipeline; }
+
+ia_status ia_pipeline_set_option(ia_pipeline *pipeline, const char *name,
+                                 const char *value) {
+  if (!pipeline || !name || !value) {
+    return fail(IA_INVALID_ARGUMENT, "null argument");
+  }
+  return guarded([&]() { set_option(pipeline->options, name, value); });
+}
+
+ia_status ia_pipeline_load_config(ia_pipeline *pipeline, const char *path) {
+  if (!pipeline || !path) {
+    return fail(IA_INVALID_ARGUMENT, "null argument");
+  }
+  return guarded([&]() { load_options(pipeline->options, path); });
+}
+
+ia_status ia_pipeline_run(ia_pipeline *pipeline, const unsigned char *pixels,
+                          int width, int height, size_t stride, int channels,
+                          unsigned char *mask, size_t mask_stride) {
+  return ia_pipeline_run_roi(pipeline, pixels, width, height, stride, channels,
+                             0, 0, width, height, mask, mask_stride);
+}
+
+ia_status ia_pipeline_run_roi(ia_pipeline *pipeline,
+                              const unsigned char *pixels, int width,
+                              int height, size_t stride, int channels,
+                              int roi_x, int roi_y, int roi_width,
+                              int roi_height, unsigned char *mask,
+                              size_t mask_stride) {
+  if (!pipeline || !pixels || !mask) {
+    return fail(IA_INVALID_ARGUMENT, "null argument");
+  }
+  if (width <= 0 || height <= 0 || channels < 1 || channels > 4 ||
+      stride < static_cast<size_t>(width) * channels) {
+    return fail(IA_INVALID_ARGUMENT, "invalid image dimensions");
+  }
+  if (roi_x < 0 || roi_y < 0 || roi_width <= 0 || roi_height <= 0 ||
+      roi_x > width - roi_width || roi_y > height - roi_height ||
+      mask_stride < static_cast<size_t>(roi_width)) {
+    return fail(IA_INVALID_ARGUMENT, "invalid region of interest");
+  }
+
+  return guarded([&]() {
+    ImageView<const unsigned char> input(pixels, width, height, stride);
+    ImageView<unsigned char> output(mask, roi_width, roi_height, mask_stride);
+    Rect roi{static_cast<size_t>(roi_x), static_cast<size_t>(roi_y),
+             static_cast<size_t>(roi_width), static_cast<size_t>(roi_height)};
+
+    PipelineMetrics metrics;
+    run_pipeline(input, channels, roi, output, pipeline->options, metrics);
+    pipeline->metrics = metrics.values();
+  });
+}
+
+ia_status ia_pipeline_get_metric(const ia_pipeline *pipeline,
+                                 const char *name, double *value) {
+  if (!pipeline || !name || !value) {
+    return fail(IA_INVALID_ARGUMENT, "null argument");
+  }
+  auto metric = pipeline->metrics.find(name);
+  if (metric == pipeline->metrics.end()) {
+    return fail(IA_INVALID_ARGUMENT, std::string("no metric ") + name);
+  }
+  *value = metric->second;
+  return IA_OK;
+}
+
+void ia_release_buffers(void) { BufferPool::thread_pool().clear(); }
+
+const char *ia_last_error(void) { return last_error.c_str(); }
+
+} // extern "C"
@@ -0,0 +1,94 @@
+#ifndef IMAGE_ANALYSIS_H
+#define IMAGE_ANALYSIS_H
+
+/*
+ * C API for running the image-analysis pipeline in-process on caller-owned
+ * memory. Pipelines are opaque; options are set and metrics read by name, so
+ * new ones can be added without changing the ABI.
+ *
+ * A pipeline may be reused for any number of images but must not be used from
+ * several threads at once. Separate pipelines are independent.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IA_API_VERSION 3
+
+typedef enum ia_status {
+  IA_OK = 0,
+  IA_INVALID_ARGUMENT = 1,
+  IA_FAILED = 2
+} ia_status;
+
+typedef struct ia_pipeline ia_pipeline;
+
+/* Returns IA_API_VERSION of the library that is actually linked. */
+int ia_api_version(void);
+
+/* Returns NULL if the pipeline could not be allocated. */
+ia_pipeline *ia_pipeline_create(void);
+void ia_pipeline_destroy(ia_pipeline *pipeline);
+
+/*
+ * Sets an option by name, e.g. ("perf", "1"). Progress output ("verbose") is
+ * off by default for pipelines created through this API.
+ */
+ia_status ia_pipeline_set_option(ia_pipeline *pipeline, const char *name,
+                                 const char *value);
+
+/*
+ * Sets the options listed in a config file, one "name = value" per line ('#'
+ * starts a comment). On error no option is changed. Since API version 2.
+ */
+ia_status ia_pipeline_load_config(ia_pipeline *pipeline, const char *path);
+
+/*
+ * Runs the pipeline on an 8-bit interleaved image with `channels` bytes per
+ * pixel and writes the binary mask (0 or 255) into `mask`. Strides are in
+ * bytes and may include padding.
+ */
+ia_status ia_pipeline_run(ia_pipeline *pipeline, const unsigned char *pixels,
+                          int width, int height, size_t stride, int channels,
+                          unsigned char *mask, size_t mask_stride);
+
+/*
+ * Like ia_pipeline_run, but only for the roi_width x roi_height rectangle at
+ * (roi_x, roi_y). `mask` is ROI-sized. Work scales with the ROI area rather
+ * than the image area, and the threshold histogram is taken over the ROI.
+ */
+ia_status ia_pipeline_run_roi(ia_pipeline *pipeline,
+                              const unsigned char *pixels, int width,
+                              int height, size_t stride, int channels,
+                              int roi_x, int roi_y, int roi_width,
+                              int roi_height, unsigned char *mask,
+                              size_t mask_stride);
+
+/*
+ * Reads a metric from the last successful run, e.g. "threshold",
+ * "total.seconds" or "dialate.cycles". Returns IA_INVALID_ARGUMENT if the
+ * metric does not exist or was not collected.
+ */
+ia_status ia_pipeline_get_metric(const ia_pipeline *pipeline,
+                                 const char *name, double *value);
+
+/*
+ * Frees the image memory the calling thread keeps for reuse. Runs recycle
+ * their buffers through a per-thread pool ("buffer-pool", on by default)
+ * that retains up to "buffer-pool-size" MiB (256 by default) per thread until
+ * the thread exits; call this on a thread that is done running pipelines, or
+ * between bursts of work, to give that memory back. Since API version 3.
+ */
+void ia_release_buffers(void);
+
+/* Describes the last error on the calling thread. Never returns NULL. */
+const char *ia_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
+#include "image_memory.h"
+
+// Row starts of every ImageBuffer are aligned to a cache line, which is also
+// wide enough for any SIMD load the kernels use.
+constexpr size_t IMAGE_ALIGNMENT = 64;
+
+// An axis-aligned rectangle of pixels.
+struct Rect {
+  size_t x = 0, y = 0, width = 0, height = 0;
+
+  size_t area() const { return width * height; }
+  bool operator==(const Rect &other) const {
+    return x == other.x && y == other.y && width == other.width &&
+           height == other.height;
+  }
+};
+
+// Grows `rect` by `radius` pixels on every side, clipped to a `width` x
+// `height` image. Used to derive the halo a stencil stage must read.
+inline Rect expand_rect(const Rect &rect, size_t radius, size_t width,
+                        size_t height) {
+  Rect grown;
+  grown.x = rect.x > radius ? rect.x - radius : 0;
+  grown.y = rect.y > radius ? rect.y - radius : 0;
+  grown.width = std::min(rect.x + rect.width + radius, width) - grown.x;
+  grown.height = std::min(rect.y + rect.height + radius, height) - grown.y;
+  return grown;
+}
+
+// A non-owning view of a 2D image. `stride` is the distance between the starts
+// of consecutive rows, in elements, and may be larger than `width`.
+template <typename T> struct ImageView {
+  T *data = nullptr;
+  size_t width = 0, height = 0, stride = 0;
+
+  ImageView() = default;
+  ImageView(T *data, size_t width, size_t height, size_t stride)
+      : data(data), width(width), height(height), stride(stride) {}
+  ImageView(T *data, size_t width, size_t height)
+      : ImageView(data, width, height, width) {}
+
+  // Allows passing a mutable view wherever a read-only one is expected.
+  operator ImageView<const T>() const {
+    return ImageView<const T>(data, width, height, stride);
+  }
+
+  T *row(size_t y) const { return data + y * stride; }
+  T &at(size_t x, size_t y) const { return data[y * stride + x]; }
+
+  bool empty() const { return width == 0 || height == 0; }
+
+  // A view of the `w` x `h` region whose top-left pixel is (x, y), sharing
+  // this view's memory. For interleaved images `pixel_size` is the number of
+  // elements per pixel (the stride is always in elements).
+  ImageView sub(size_t x, size_t y, size_t w, size_t h,
+                size_t pixel_size = 1) const {
+    if (x + w > width || y + h > height) {
+      throw std::out_of_range("sub-view exceeds image bounds");
+    }
+    return ImageView(data + y * stride + x * pixel_size, w, h, stride);
+  }
+  ImageView sub(const Rect &rect, size_t pixel_size = 1) const {
+    return sub(rect.x, rect.y, rect.width, rect.height, pixel_size);
+  }
+};
+
+// An owning, aligned image. Each row is padded so that it starts on an
+// IMAGE_ALIGNMENT boundary, and large images are backed by huge pages (see
+// image_memory.h). While a BufferPool is active the memory is recycled
+// through it. The pixels are left uninitialised; every pipeline stage writes
+// all of its output pixels.
+template <typename T> class ImageBuffer {
+  static_assert(std::is_trivial<T>::value,
+                "ImageBuffer does not construct its elements");
+
+public:
+  ImageBuffer() = default;
+
+  ImageBuffer(size_t width, size_t height)
+      : width_(width), height_(height), stride_(padded_stride(width)) {
+    if (width == 0 || height == 0) {
+      return;
+    }
+    size_t bytes = stride_ * height_ * sizeof(T), mapped = 0;
+    BufferPool *pool = BufferPool::active();
+    void *memory = pool ? pool->acquire(bytes, mapped)
+                        : allocate_image_memory(bytes, mapped);
+    pixels = std::unique_ptr<T, ImageDelete>(
+        static_cast<T *>(memory),
+        ImageDelete{pool, bytes, mapped, huge_pages()});
+  }
+
+  size_t width() const { return width_; }
+  size_t height() const { return height_; }
+  size_t stride() const { return stride_; }
+
+  T *data() { return pixels.get(); }
+  const T *data() const { return pixels.get(); }
+
+  ImageView<T> view() { return {data(), width_, height_, stride_}; }
+  ImageView<const T> view() const { return {data(), width_, height_, stride_}; }
+
+  T *row(size_t y) { return data() + y * stride_; }
+  const T *row(size_t y) const { return data() + y * stride_; }
+
+private:
+  struct ImageDelete {
+    BufferPool *pool = nullptr;
+    size_t bytes = 0, mapped = 0;
+    HugePages policy = HugePages::TRANSPARENT;
+    void operator()(T *memory) const {
+      // Pools are not thread-safe and may be gone once their scope ends, so
+      // only a pool still active on this thread gets the block back.
+      if (pool && pool == BufferPool::active()) {
+        pool->release(memory, bytes, mapped, policy);
+      } else {
+        free_image_memory(memory, mapped);
+      }
+    }
+  };
+
+  static size_t padded_stride(size_t width) {
+    constexpr size_t per_line = IMAGE_ALIGNMENT / sizeof(T);
+    return (width + per_line - 1) / per_line * per_line;
+  }
+
+  std::unique_ptr<T, ImageDelete> pixels;
+  size_t width_ = 0, height_ = 0, stride_ = 0;
+};
@@ -0,0 +1,163 @@
+#include "image_memory.h"
+
+#include <sys/mman.h>
+
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+
+#include "image_buffer.h"
+
+namespace {
+
+thread_local HugePages policy = HugePages::TRANSPARENT;
+
+thread_local BufferPool *active_pool = nullptr;
+
+size_t round_up(size_t bytes, size_t multiple) {
+  return (bytes + multiple - 1) / multiple * multiple;
+}
+
+// A HUGE_PAGE_SIZE-aligned anonymous mapping of `length` bytes, or null.
+// mmap only guarantees page alignment, so map one huge page extra and trim
+// the ends.
+void *map_aligned(size_t length) {
+  size_t padded = length + HUGE_PAGE_SIZE;
+  void *memory = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+  uintptr_t aligned = round_up(start, HUGE_PAGE_SIZE);
+  if (aligned > start) {
+    munmap(memory, aligned - start);
+  }
+  size_t tail = start + padded - (aligned + length);
+  if (tail > 0) {
+    munmap(reinterpret_cast<void *>(aligned + length), tail);
+  }
+  return reinterpret_cast<void *>(aligned);
+}
+
+} // namespace
+
+HugePages parse_huge_pages(const std::string &name) {
+  if (name == "off") {
+    return HugePages::OFF;
+  }
+  if (name == "thp") {
+    return HugePages::TRANSPARENT;
+  }
+  if (name == "hugetlb") {
+    return HugePages::HUGETLB;
+  }
+  throw std::invalid_argument("unknown huge page policy " + name);
+}
+
+HugePages huge_pages() { return policy; }
+
+HugePagesScope::HugePagesScope(HugePages huge_pages) : previous_(policy) {
+  policy = huge_pages;
+}
+
+HugePagesScope::~HugePagesScope() { policy = previous_; }
+
+void *allocate_image_memory(size_t bytes, size_t &mapped) {
+  HugePages current = policy;
+  if (current == HugePages::OFF || bytes < HUGE_PAGE_SIZE) {
+    mapped = 0;
+    return ::operator new(bytes, std::align_val_t(IMAGE_ALIGNMENT));
+  }
+
+  size_t length = round_up(bytes, HUGE_PAGE_SIZE);
+  if (current == HugePages::HUGETLB) {
+    void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+      mapped = length;
+      return memory;
+    }
+  }
+
+  void *memory = map_aligned(length);
+  if (!memory) {
+    throw std::bad_alloc();
+  }
+  // Advisory: without THP support the mapping simply stays on 4 KB pages.
+  madvise(memory, length, MADV_HUGEPAGE);
+  mapped = length;
+  return memory;
+}
+
+void free_image_memory(void *memory, size_t mapped) {
+  if (mapped == 0) {
+    ::operator delete(memory, std::align_val_t(IMAGE_ALIGNMENT));
+  } else {
+    munmap(memory, mapped);
+  }
+}
+
+BufferPool::BufferPool(size_t max_retained) : max_retained_(max_retained) {}
+
+BufferPool::~BufferPool() { clear(); }
+
+void *BufferPool::acquire(size_t bytes, size_t &mapped) {
+  auto found = free_.find({bytes, policy});
+  if (found != free_.end() && !found->second.empty()) {
+    Block block = found->second.back();
+    found->second.pop_back();
+    retained_ -= bytes;
+    ++hits_;
+    mapped = block.mapped;
+    return block.memory;
+  }
+  ++misses_;
+  return allocate_image_memory(bytes, mapped);
+}
+
+void BufferPool::release(void *memory, size_t bytes, size_t mapped,
+                         HugePages policy) {
+  if (retained_ + bytes > max_retained_) {
+    free_image_memory(memory, mapped);
+    return;
+  }
+  free_[{bytes, policy}].push_back({memory, mapped});
+  retained_ += bytes;
+}
+
+void BufferPool::clear() {
+  for (auto &entry : free_) {
+    for (const Block &block : entry.second) {
+      free_image_memory(block.memory, block.mapped);
+    }
+  }
+  free_.clear();
+  retained_ = 0;
+}
+
+void BufferPool::set_max_retained(size_t max_retained) {
+  max_retained_ = max_retained;
+  for (auto entry = free_.begin();
+       retained_ > max_retained_ && entry != free_.end(); ++entry) {
+    std::vector<Block> &blocks = entry->second;
+    while (retained_ > max_retained_ && !blocks.empty()) {
+      free_image_memory(blocks.back().memory, blocks.back().mapped);
+      blocks.pop_back();
+      retained_ -= entry->first.first;
+    }
+  }
+}
+
+BufferPool *BufferPool::active() { return active_pool; }
+
+BufferPool &BufferPool::thread_pool() {
+  thread_local BufferPool pool;
+  return pool;
+}
+
+BufferPoolScope::BufferPoolScope(BufferPool *pool) : previous_(active_pool) {
+  active_pool = pool;
+}
+
+BufferPoolScope::~BufferPoolScope() { active_pool = previous_; }
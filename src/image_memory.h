@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How large image buffers are backed.
+enum class HugePages {
+  // Plain aligned operator new.
+  OFF,
+  // Anonymous mappings aligned to HUGE_PAGE_SIZE with madvise(MADV_HUGEPAGE),
+  // so transparent huge pages back them whenever the kernel has them.
+  TRANSPARENT,
+  // MAP_HUGETLB from the hugetlbfs pool, falling back to TRANSPARENT when the
+  // pool is empty or not configured.
+  HUGETLB,
+};
+
+// Parses "off", "thp" or "hugetlb".
+HugePages parse_huge_pages(const std::string &name);
+
+// Buffers smaller than this always use operator new; a huge page for them
+// would mostly be padding.
+constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+// The policy for image buffers allocated on the calling thread: TRANSPARENT,
+// or that of the innermost HugePagesScope. Buffers already allocated keep
+// their backing.
+HugePages huge_pages();
+
+// Makes `policy` the calling thread's huge page policy for the scope's
+// lifetime, so that pipelines with different policies running on other
+// threads do not affect each other. Scopes nest.
+class HugePagesScope {
+public:
+  explicit HugePagesScope(HugePages policy);
+  ~HugePagesScope();
+  HugePagesScope(const HugePagesScope &) = delete;
+  HugePagesScope &operator=(const HugePagesScope &) = delete;
+
+private:
+  HugePages previous_;
+};
+
+// Uninitialised memory for `bytes` of pixels, aligned to at least
+// IMAGE_ALIGNMENT and backed as huge_pages() asks. `mapped` receives the
+// length of the mapping backing it, or 0 for operator new, and must be passed
+// back to free_image_memory.
+// Throws std::bad_alloc.
+void *allocate_image_memory(size_t bytes, size_t &mapped);
+void free_image_memory(void *memory, size_t mapped);
+
+// A cache of freed image memory keyed by size, so that a batch of
+// same-sized images reuses warm, already faulted-in buffers instead of
+// mapping and zero-filling fresh pages for every image. While a pool is
+// active on a thread (see BufferPoolScope), every ImageBuffer allocated on
+// that thread is taken from it, and returned to it if it is destroyed on that
+// thread while the pool is still active; otherwise, e.g. after being moved to
+// another thread or kept past the scope, it is freed normally. A pool must
+// not be active on several threads at once.
+class BufferPool {
+public:
+  // At most `max_retained` bytes of free memory are kept; beyond that,
+  // released memory is freed.
+  explicit BufferPool(size_t max_retained = DEFAULT_MAX_RETAINED);
+  ~BufferPool();
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // As allocate_image_memory, reusing a released block of the same size and
+  // huge page policy if there is one.
+  void *acquire(size_t bytes, size_t &mapped);
+  // `policy` is the huge_pages() the block was acquired under.
+  void release(void *memory, size_t bytes, size_t mapped, HugePages policy);
+
+  // Frees every retained block.
+  void clear();
+
+  // Changes the cap on retained memory, freeing blocks until the pool is
+  // within it.
+  void set_max_retained(size_t max_retained);
+
+  static constexpr size_t DEFAULT_MAX_RETAINED = size_t(256) << 20;
+
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+  size_t retained_bytes() const { return retained_; }
+
+  // The pool active on the calling thread, or null.
+  static BufferPool *active();
+
+  // The calling thread's own pool, created on first use and freed when the
+  // thread exits. Until then it holds on to what it retains, which
+  // ia_release_buffers frees for library users.
+  static BufferPool &thread_pool();
+
+private:
+  struct Block {
+    void *memory;
+    size_t mapped;
+  };
+  // Blocks are only reused under the policy they were allocated with.
+  using BlockSize = std::pair<size_t, HugePages>;
+
+  size_t max_retained_;
+  size_t retained_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  std::map<BlockSize, std::vector<Block>> free_;
+};
+
+// Makes `pool` (which may be null, for no pool) active on the calling thread
+// for the scope's lifetime. Scopes nest.
+class BufferPoolScope {
+public:
+  explicit BufferPoolScope(BufferPool *pool);
+  ~BufferPoolScope();
+  BufferPoolScope(const BufferPoolScope &) = delete;
+  BufferPoolScope &operator=(const BufferPoolScope &) = delete;
+
+private:
+  BufferPool *previous_;
+};
@@ -0,0 +1,254 @@
+#include "linear_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+#include "parallel.h"
+
+namespace {
+
+// A filter resolved for one axis length. Outputs at least the radius away
+// from both ends share the centred taps; only those near an end have taps
+// of their own.
+class BoundFilter {
+public:
+  BoundFilter(const Filter1D &filter, size_t length)
+      : radius_(filter.radius()), length_(length) {
+    interior_ = filter.taps_at(radius_, 2 * radius_ + 1).weights;
+    size_t near_end = std::min(radius_, length);
+    far_begin_ = std::max(near_end, length > radius_ ? length - radius_ : 0);
+    for (size_t x = 0; x < near_end; ++x) {
+      near_.push_back(filter.taps_at(x, length));
+    }
+    for (size_t x = far_begin_; x < length; ++x) {
+      far_.push_back(filter.taps_at(x, length));
+    }
+  }
+
+  size_t radius() const { return radius_; }
+
+  // Output `x`'s first input pixel, its weights and how many there are.
+  size_t start(size_t x) const {
+    const FilterTaps *taps = edge(x);
+    return taps ? taps->start : x - radius_;
+  }
+  const float *weights(size_t x) const {
+    const FilterTaps *taps = edge(x);
+    return taps ? taps->weights.data() : interior_.data();
+  }
+  size_t count(size_t x) const {
+    const FilterTaps *taps = edge(x);
+    return taps ? taps->weights.size() : interior_.size();
+  }
+
+private:
+  const FilterTaps *edge(size_t x) const {
+    if (x < near_.size()) {
+      return &near_[x];
+    }
+    return x >= far_begin_ ? &far_[x - far_begin_] : nullptr;
+  }
+
+  size_t radius_, length_, far_begin_;
+  std::vector<float> interior_;
+  std::vector<FilterTaps> near_, far_;
+};
+
+// One output row of every filter's column pass followed by its row pass,
+// combined by `combine(filter, value)`, for the pixels of `region` in row y.
+template <typename Combine>
+void filter_row(ImageView<const float> input, size_t y, const Rect &region,
+                const std::vector<BoundFilter> &rows,
+                const std::vector<BoundFilter> &columns,
+                std::vector<std::vector<float>> &lines, float *out,
+                Combine combine) {
+  for (size_t f = 0; f < rows.size(); ++f) {
+    // The columns the row pass reads.
+    size_t line_start = rows[f].start(region.x);
+    size_t last = region.x + region.width - 1;
+    size_t line_end = rows[f].start(last) + rows[f].count(last);
+
+    std::vector<float> &line = lines[f];
+    line.assign(line_end - line_start, 0.0f);
+    const float *column_weights = columns[f].weights(y);
+    size_t column_start = columns[f].start(y);
+    for (size_t i = 0; i < columns[f].count(y); ++i) {
+      float weight = column_weights[i];
+      if (weight == 0.0f) {
+        continue;
+      }
+      const float *row = input.row(column_start + i) + line_start;
+      for (size_t x = 0; x < line.size(); ++x) {
+        line[x] += weight * row[x];
+      }
+    }
+
+    for (size_t x = region.x; x < region.x + region.width; ++x) {
+      const float *row_weights = rows[f].weights(x);
+      const float *pixels = line.data() + (rows[f].start(x) - line_start);
+      float value = 0.0f;
+      for (size_t i = 0; i < rows[f].count(x); ++i) {
+        value += row_weights[i] * pixels[i];
+      }
+      combine(f, out[x], value);
+    }
+  }
+}
+
+template <typename Combine>
+void apply_filters(ImageView<const float> input, ImageView<float> output,
+                   const Rect &region,
+                   const std::vector<SeparableFilter> &filters,
+                   Combine combine) {
+  if (input.width != output.width || input.height != output.height) {
+    throw std::invalid_argument("filter input and output sizes differ");
+  }
+  if (region.x + region.width > input.width ||
+      region.y + region.height > input.height) {
+    throw std::out_of_range("filter region exceeds image bounds");
+  }
+  if (region.area() == 0) {
+    return;
+  }
+
+  std::vector<BoundFilter> rows, columns;
+  for (const SeparableFilter &filter : filters) {
+    rows.emplace_back(filter.rows, input.width);
+    columns.emplace_back(filter.columns, input.height);
+  }
+
+  parallel_for(region.height, [&](size_t begin, size_t end) {
+    std::vector<std::vector<float>> lines(filters.size());
+    for (size_t y = region.y + begin; y < region.y + end; ++y) {
+      filter_row(input, y, region, rows, columns, lines, output.row(y),
+                 combine);
+    }
+  });
+}
+
+} // namespace
+
+Filter1D::Filter1D(std::vector<float> taps, FilterEdge edge)
+    : radius_(taps.size() / 2), taps_(std::move(taps)), edge_(edge) {
+  if (taps_.size() % 2 == 0) {
+    throw std::invalid_argument("filter taps must have odd length");
+  }
+}
+
+Filter1D Filter1D::box_mean(int radius) {
+  return Filter1D(std::vector<float>(2 * radius + 1, 1.0f),
+                  FilterEdge::RENORMALISE);
+}
+
+Filter1D Filter1D::then(const Filter1D &next) const {
+  Filter1D composed;
+  composed.radius_ = radius_ + next.radius_;
+  for (const Filter1D *filter : {this, &next}) {
+    if (filter->parts_.empty()) {
+      composed.parts_.push_back(std::make_shared<Filter1D>(*filter));
+    } else {
+      composed.parts_.insert(composed.parts_.end(), filter->parts_.begin(),
+                             filter->parts_.end());
+    }
+  }
+  return composed;
+}
+
+FilterTaps Filter1D::taps_at(size_t x, size_t length) const {
+  if (parts_.empty()) {
+    FilterTaps taps;
+    size_t first = x > radius_ ? x - radius_ : 0;
+    size_t last = std::min(x + radius_, length - 1);
+    taps.start = first;
+    float inside = 0.0f;
+    for (size_t p = first; p <= last; ++p) {
+      float tap = taps_[p + radius_ - x];
+      taps.weights.push_back(tap);
+      inside += tap;
+    }
+    if (edge_ == FilterEdge::RENORMALISE) {
+      for (float &weight : taps.weights) {
+        weight *= 1.0f / inside;
+      }
+    }
+    return taps;
+  }
+
+  // Pull the weights back through the parts, last to first.
+  FilterTaps taps = parts_.back()->taps_at(x, length);
+  for (size_t part = parts_.size() - 1; part-- > 0;) {
+    FilterTaps inner;
+    inner.start = length;
+    size_t end = 0;
+    std::vector<FilterTaps> sources;
+    for (size_t i = 0; i < taps.weights.size(); ++i) {
+      sources.push_back(parts_[part]->taps_at(taps.start + i, length));
+      inner.start = std::min(inner.start, sources.back().start);
+      end = std::max(end,
+                     sources.back().start + sources.back().weights.size());
+    }
+    inner.weights.assign(end - inner.start, 0.0f);
+    for (size_t i = 0; i < sources.size(); ++i) {
+      for (size_t k = 0; k < sources[i].weights.size(); ++k) {
+        inner.weights[sources[i].start + k - inner.start] +=
+            taps.weights[i] * sources[i].weights[k];
+      }
+    }
+    taps = std::move(inner);
+  }
+  return taps;
+}
+
+SeparableFilter separate(const std::vector<std::vector<float>> &kernel,
+                         FilterEdge edge) {
+  size_t size = kernel.size();
+  size_t pivot_y = 0, pivot_x = 0;
+  for (size_t y = 0; y < size; ++y) {
+    if (kernel[y].size() != size) {
+      throw std::invalid_argument("kernel is not square");
+    }
+    for (size_t x = 0; x < size; ++x) {
+      if (std::abs(kernel[y][x]) > std::abs(kernel[pivot_y][pivot_x])) {
+        pivot_y = y;
+        pivot_x = x;
+      }
+    }
+  }
+  float pivot = size ? kernel[pivot_y][pivot_x] : 0.0f;
+  if (pivot == 0.0f) {
+    throw std::invalid_argument("kernel is zero");
+  }
+
+  // Columns take the pivot's column as is, rows its row scaled to 1 at the
+  // pivot, so integer kernels factor exactly.
+  std::vector<float> rows(size), columns(size);
+  for (size_t i = 0; i < size; ++i) {
+    rows[i] = kernel[pivot_y][i] / pivot;
+    columns[i] = kernel[i][pivot_x];
+  }
+  for (size_t y = 0; y < size; ++y) {
+    for (size_t x = 0; x < size; ++x) {
+      if (columns[y] * rows[x] != kernel[y][x]) {
+        throw std::invalid_argument("kernel is not separable");
+      }
+    }
+  }
+  return {Filter1D(rows, edge), Filter1D(columns, edge)};
+}
+
+void apply_separable(ImageView<const float> input, ImageView<float> output,
+                     const Rect &region, const SeparableFilter &filter) {
+  apply_filters(input, output, region, {filter},
+                [](size_t, float &out, float value) { out = value; });
+}
+
+void apply_separable_abs_sum(ImageView<const float> input,
+                             ImageView<float> output, const Rect &region,
+                             const std::vector<SeparableFilter> &filters) {
+  apply_filters(input, output, region, filters,
+                [](size_t f, float &out, float value) {
+                  out = (f == 0 ? 0.0f : out) + std::abs(value);
+                });
+}
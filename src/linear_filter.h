@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "image_buffer.h"
+
+// How a 1-D filter treats the taps that fall outside the image.
+enum class FilterEdge {
+  // They are dropped, as if the image were surrounded by zeros
+  // (sobel_operator).
+  ZERO,
+  // They are dropped and the remaining taps scaled to sum to one, so a mean
+  // stays a mean of the pixels inside (blur_operator).
+  RENORMALISE,
+};
+
+// The weights one output pixel applies along an axis: weights[i] multiplies
+// input pixel start + i.
+struct FilterTaps {
+  size_t start = 0;
+  std::vector<float> weights;
+};
+
+// A linear filter along one axis, written as a correlation: tap i of a
+// radius-r filter weighs the pixel i - r away from the output. Filters
+// compose exactly, edges included, so a chain of linear stencils can be
+// collapsed into one filter per axis and applied in a single pass.
+class Filter1D {
+public:
+  // `taps` must have odd length.
+  Filter1D(std::vector<float> taps, FilterEdge edge);
+
+  // The mean of the 2 * radius + 1 pixels around the output, or of those
+  // inside the image near an edge.
+  static Filter1D box_mean(int radius);
+
+  // Applies this filter, then `next`, to the result.
+  Filter1D then(const Filter1D &next) const;
+
+  size_t radius() const { return radius_; }
+
+  // The weights output `x` of an axis of `length` pixels applies.
+  FilterTaps taps_at(size_t x, size_t length) const;
+
+private:
+  Filter1D() = default;
+
+  size_t radius_ = 0;
+  // Leaf filters: the taps and their edge handling.
+  std::vector<float> taps_;
+  FilterEdge edge_ = FilterEdge::ZERO;
+  // Composed filters: the parts, applied in order.
+  std::vector<std::shared_ptr<const Filter1D>> parts_;
+};
+
+// A 2-D filter that is the product of a filter along rows (x) and one along
+// columns (y). The axes act independently, so the order is immaterial.
+struct SeparableFilter {
+  Filter1D rows;
+  Filter1D columns;
+
+  // Applies this filter, then `next`, to the result.
+  SeparableFilter then(const SeparableFilter &next) const {
+    return {rows.then(next.rows), columns.then(next.columns)};
+  }
+};
+
+// Factors a rank-one kernel (odd-sized and square, kernel[y][x] read as a
+// correlation like the SOBEL tables) into a row and a column filter with the
+// given edge handling. Throws std::invalid_argument if it does not factor.
+SeparableFilter separate(const std::vector<std::vector<float>> &kernel,
+                         FilterEdge edge);
+
+// Applies `filter` to `input` over `region` of `output`, in one row-parallel
+// pass with only per-thread line buffers. The views must have the same size
+// and must not overlap; their edges are the image edges.
+void apply_separable(ImageView<const float> input, ImageView<float> output,
+                     const Rect &region, const SeparableFilter &filter);
+
+// As apply_separable, but writes the sum of the absolute responses of all
+// `filters`, e.g. |gx| + |gy| for a gradient pair.
+void apply_separable_abs_sum(ImageView<const float> input,
+                             ImageView<float> output, const Rect &region,
+                             const std::vector<SeparableFilter> &filters);
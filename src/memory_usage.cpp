@@ -0,0 +1,49 @@
+#include "memory_usage.h"
+
+#include <sys/resource.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+// A "<field>: <n> kB" line of /proc/self/status, in bytes, or 0.
+size_t status_field(const char *field) {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  size_t length = std::char_traits<char>::length(field);
+  while (std::getline(status, line)) {
+    if (line.compare(0, length, field) == 0 && line.size() > length &&
+        line[length] == ':') {
+      std::istringstream value(line.substr(length + 1));
+      size_t kilobytes = 0;
+      value >> kilobytes;
+      return kilobytes * 1024;
+    }
+  }
+  return 0;
+}
+
+} // namespace
+
+size_t current_rss_bytes() { return status_field("VmRSS"); }
+
+size_t peak_rss_bytes() {
+  size_t peak = status_field("VmHWM");
+  if (peak > 0) {
+    return peak;
+  }
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  // Linux reports ru_maxrss in kilobytes.
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+}
+
+bool reset_peak_rss() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5" << std::flush;
+  return static_cast<bool>(clear_refs);
+}
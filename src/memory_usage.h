@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+// Resident set size of the process right now, from /proc/self/status
+// (VmRSS). 0 if unavailable.
+size_t current_rss_bytes();
+
+// Highest resident set size of the process so far: VmHWM from
+// /proc/self/status, falling back to getrusage's ru_maxrss.
+size_t peak_rss_bytes();
+
+// Restarts the high-water mark at the current RSS (via /proc/self/clear_refs),
+// so that peak_rss_bytes covers only what follows. Affects the whole process.
+// Returns false if the kernel does not support it; peak_rss_bytes is then the
+// lifetime peak.
+bool reset_peak_rss();
@@ -0,0 +1,76 @@
+#include "numa.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// From linux/mempolicy.h, which libc does not wrap.
+constexpr int MPOL_INTERLEAVE_MODE = 3;
+
+// Parses a node list such as "0-1,3" into a bitmask of 64-bit words.
+std::vector<unsigned long> online_nodes() {
+  std::vector<unsigned long> mask;
+  std::ifstream file("/sys/devices/system/node/online");
+  std::string list;
+  if (!std::getline(file, list)) {
+    return mask;
+  }
+  std::stringstream ranges(list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    size_t first = 0, last = 0;
+    char dash;
+    std::stringstream parse(range);
+    if (!(parse >> first)) {
+      continue;
+    }
+    last = (parse >> dash >> last) ? last : first;
+    for (size_t node = first; node <= last; ++node) {
+      size_t bits = sizeof(unsigned long) * 8;
+      if (mask.size() <= node / bits) {
+        mask.resize(node / bits + 1);
+      }
+      mask[node / bits] |= 1ul << (node % bits);
+    }
+  }
+  return mask;
+}
+
+const std::vector<unsigned long> &node_mask() {
+  static const std::vector<unsigned long> mask = online_nodes();
+  return mask;
+}
+
+} // namespace
+
+size_t numa_node_count() {
+  size_t count = 0;
+  for (unsigned long word : node_mask()) {
+    count += __builtin_popcountl(word);
+  }
+  return count ? count : 1;
+}
+
+void interleave_pages(void *data, size_t bytes) {
+  if (numa_node_count() < 2) {
+    return;
+  }
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t start = reinterpret_cast<size_t>(data);
+  size_t first = (start + page - 1) / page * page;
+  size_t last = (start + bytes) / page * page;
+  if (last <= first) {
+    return;
+  }
+  const std::vector<unsigned long> &mask = node_mask();
+  // Best effort: a refusal (e.g. nodes outside the cpuset) just leaves the
+  // default local placement.
+  syscall(SYS_mbind, first, last - first, MPOL_INTERLEAVE_MODE, mask.data(),
+          mask.size() * sizeof(unsigned long) * 8 + 1, 0);
+}
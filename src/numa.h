@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include "image_buffer.h"
+#include "parallel.h"
+
+// Online NUMA nodes, from /sys/devices/system/node/online; 1 if unknown.
+size_t numa_node_count();
+
+// Asks the kernel to spread the pages of [data, data + bytes) round-robin
+// across all online nodes. Meant for buffers that no thread partition
+// matches (e.g. written by rows and read by column strips), so that no one
+// node serves all of their traffic. Only whole pages inside the range are
+// affected, and pages already touched keep their placement. A no-op on
+// single-node machines or if the kernel refuses.
+void interleave_pages(void *data, size_t bytes);
+
+template <typename T> void interleave_pages(ImageBuffer<T> &buffer) {
+  interleave_pages(buffer.data(),
+                   buffer.stride() * buffer.height() * sizeof(T));
+}
+
+// Zero-fills `buffer` with parallel_for's initial split of its rows, so that
+// on a NUMA machine each band's pages are placed on the node of the thread
+// that starts on those rows in the row-parallel stages (reliably so with
+// ParallelOptions::pin). Skipped on single-node machines, where it would
+// only cost a pass over the buffer.
+template <typename T> void first_touch(ImageBuffer<T> &buffer) {
+  if (numa_node_count() < 2) {
+    return;
+  }
+  ParallelContext *context = ParallelContext::current();
+  ParallelOptions options = context ? context->options() : ParallelOptions();
+  options.schedule = Schedule::STATIC;
+  ParallelContext placement(options);
+  parallel_for(buffer.height(), [&](size_t begin, size_t end) {
+    for (size_t y = begin; y < end; ++y) {
+      T *row = buffer.row(y);
+      std::fill(row, row + buffer.stride(), T());
+    }
+  });
+}
@@ -0,0 +1,266 @@
+#include "operators.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "parallel.h"
+
+float sobel_operator(ImageView<const float> input, int x, int y) {
+  int width = input.width, height = input.height;
+  float gx = 0, gy = 0;
+
+  size_t start_x = std::max(x - 1, 0), end_x = std::min(x + 1, width - 1);
+  size_t start_y = std::max(y - 1, 0), end_y = std::min(y + 1, height - 1);
+
+  for (size_t dy = start_y; dy < end_y + 1; ++dy) {
+    const float *row = input.row(dy);
+    for (size_t dx = start_x; dx < end_x + 1; ++dx) {
+      float pixel_value = row[dx];
+
+      gx += pixel_value * SOBEL_X[dy - (y - 1)][dx - (x - 1)];
+      gy += pixel_value * SOBEL_Y[dy - (y - 1)][dx - (x - 1)];
+    }
+  }
+
+  return std::abs(gx) + std::abs(gy);
+}
+
+namespace {
+
+// The mean of the pixels within `radius` of (x, y), clipped to the image.
+// Windows that fit inside the image take a path with constant bounds, which
+// for a FixedRadius unrolls completely; it adds in the same order as the
+// clipped path, so both give identical sums.
+template <typename Radius>
+float window_mean(ImageView<const float> input, int x, int y, Radius radius) {
+  int r = radius;
+  int width = input.width, height = input.height;
+  float g = 0.0f;
+
+  if (x >= r && y >= r && x + r < width && y + r < height) {
+    for (int dy = -r; dy <= r; ++dy) {
+      const float *row = input.row(y + dy) + x;
+      for (int dx = -r; dx <= r; ++dx) {
+        g += row[dx];
+      }
+    }
+    return g / static_cast<float>((2 * r + 1) * (2 * r + 1));
+  }
+
+  int start_x = std::max(x - r, 0), end_x = std::min(x + r, width - 1);
+  int start_y = std::max(y - r, 0), end_y = std::min(y + r, height - 1);
+
+  int divisor = (end_x - start_x + 1) * (end_y - start_y + 1);
+
+  for (int dy = start_y; dy <= end_y; ++dy) {
+    const float *row = input.row(dy);
+    for (int dx = start_x; dx <= end_x; ++dx) {
+      g += row[dx];
+    }
+  }
+  return g / static_cast<float>(divisor);
+}
+
+} // namespace
+
+void check_parameters(const StageParameters &parameters) {
+  auto check = [](const char *name, int value, int limit) {
+    if (value < 1 || value > limit) {
+      throw std::invalid_argument(std::string(name) + " must be in [1, " +
+                                  std::to_string(limit) + "], got " +
+                                  std::to_string(value));
+    }
+  };
+  // Dialate's 8-bit passes are only exact while a full window's sum of 0/255
+  // bytes stays below 2^24, where dialate_operator's float mean is exact:
+  // (2 * 127 + 1)^2 * 255 < 2^24. That also keeps its per-column counts in
+  // 16 bits and its table of thresholds per window area small.
+  check("denoise count", parameters.denoise_count, 1 << 16);
+  check("denoise radius", parameters.denoise_radius, MAX_DENOISE_RADIUS);
+  check("blur count", parameters.blur_count, 1 << 16);
+  check("blur radius", parameters.blur_radius, 1 << 16);
+  check("certainty", parameters.certainty, 256);
+}
+
+float blur_operator(ImageView<const float> input, int x, int y, int radius) {
+  return window_mean(input, x, y, RuntimeRadius{radius});
+}
+
+KernelFunc blur_kernel(int radius) {
+  return with_radius(radius, [](auto r) -> KernelFunc {
+    return [r](ImageView<const float> input, int x, int y) {
+      return window_mean(input, x, y, r);
+    };
+  });
+}
+
+std::vector<SeparableFilter> blurred_sobel_filters(int blur_radius) {
+  SeparableFilter blur{Filter1D::box_mean(blur_radius),
+                       Filter1D::box_mean(blur_radius)};
+  std::vector<SeparableFilter> gradients;
+  for (const auto &table : {SOBEL_X, SOBEL_Y}) {
+    std::vector<std::vector<float>> kernel(3, std::vector<float>(3));
+    for (int y = 0; y < 3; ++y) {
+      for (int x = 0; x < 3; ++x) {
+        kernel[y][x] = static_cast<float>(table[y][x]);
+      }
+    }
+    gradients.push_back(blur.then(separate(kernel, FilterEdge::ZERO)));
+  }
+  return gradients;
+}
+
+float dialate_operator(ImageView<const float> input, int x, int y,
+                       int radius) {
+  if (input.at(x, y) == 0.0f) {
+    return 0;
+  }
+  return window_mean(input, x, y, RuntimeRadius{radius});
+}
+
+KernelFunc dialate_kernel(int radius) {
+  return with_radius(radius, [](auto r) -> KernelFunc {
+    return [r](ImageView<const float> input, int x, int y) {
+      return input.at(x, y) == 0.0f ? 0.0f : window_mean(input, x, y, r);
+    };
+  });
+}
+
+void apply_kernel(ImageView<const float> input, ImageView<float> output,
+                  KernelFunc kernel_func) {
+  apply_kernel(input, output, kernel_func,
+               Rect{0, 0, input.width, input.height});
+}
+
+void apply_kernel(ImageView<const float> input, ImageView<float> output,
+                  KernelFunc kernel_func, const Rect &region) {
+  if (input.width != output.width || input.height != output.height) {
+    throw std::invalid_argument("kernel input and output sizes differ");
+  }
+  if (region.x + region.width > input.width ||
+      region.y + region.height > input.height) {
+    throw std::out_of_range("kernel region exceeds image bounds");
+  }
+
+  // Row bands, so that threads which draw cheap rows (e.g. empty mask for
+  // dialate) can pick up more of them.
+  parallel_for(region.height, [&](size_t begin, size_t end) {
+    for (size_t y = region.y + begin; y < region.y + end; ++y) {
+      float *row = output.row(y);
+      for (size_t x = region.x; x < region.x + region.width; ++x) {
+        row[x] = kernel_func(input, x, y);
+      }
+    }
+  });
+}
+
+namespace {
+
+// The calling thread's tile buffers for blocked passes, each at least `edge`
+// pixels square. parallel_for's workers persist (see parallel.h), so the
+// buffers are only reallocated when a run needs larger tiles, not for every
+// group of passes; only loops that fall back to threads of their own
+// allocate per call.
+struct TileBuffers {
+  ImageBuffer<float> input, output;
+};
+
+TileBuffers &tile_buffers(size_t edge) {
+  thread_local TileBuffers buffers;
+  if (buffers.input.width() < edge) {
+    // Not from a buffer pool: the buffers outlive every pool scope.
+    BufferPoolScope no_pool(nullptr);
+    buffers.input = ImageBuffer<float>(edge, edge);
+    buffers.output = ImageBuffer<float>(edge, edge);
+  }
+  return buffers;
+}
+
+} // namespace
+
+void apply_kernel_n(ImageBuffer<float> &pixels, ImageBuffer<float> &scratch,
+                    KernelFunc kernel_func, int radius, int count,
+                    const Rect &region, const BlockingOptions &blocking,
+                    const std::function<void(int)> &progress) {
+  size_t width = pixels.width(), height = pixels.height();
+  auto needed_after = [&](int remaining) {
+    return expand_rect(region, remaining * radius, width, height);
+  };
+
+  if (blocking.depth <= 1) {
+    for (int i = 0; i < count; ++i) {
+      apply_kernel(pixels.view(), scratch.view(), kernel_func,
+                   needed_after(count - 1 - i));
+      std::swap(pixels, scratch);
+      if (progress) {
+        progress(i);
+      }
+    }
+    return;
+  }
+
+  size_t tile_size = std::max<size_t>(blocking.tile_size, 1);
+
+  int done = 0;
+  while (done < count) {
+    int depth = std::min(blocking.depth, count - done);
+    Rect group = needed_after(count - done - depth);
+
+    size_t tiles_x = (group.width + tile_size - 1) / tile_size;
+    size_t tiles_y = (group.height + tile_size - 1) / tile_size;
+
+    parallel_for(tiles_x * tiles_y, [&](size_t begin, size_t end) {
+      // Each tile's input and halo is at most this large.
+      TileBuffers &local = tile_buffers(tile_size + 2 * depth * radius);
+
+      for (size_t t = begin; t < end; ++t) {
+        Rect tile;
+        tile.x = group.x + (t % tiles_x) * tile_size;
+        tile.y = group.y + (t / tiles_x) * tile_size;
+        tile.width = std::min(tile_size, group.x + group.width - tile.x);
+        tile.height = std::min(tile_size, group.y + group.height - tile.y);
+
+        // The local views stop where the source does, so kernels clamp at
+        // the image edge exactly as before; everywhere else the shrinking
+        // regions keep reads inside what was copied or computed.
+        Rect source = expand_rect(tile, depth * radius, width, height);
+        ImageView<float> a = local.input.view().sub(0, 0, source.width,
+                                                    source.height);
+        ImageView<float> b = local.output.view().sub(0, 0, source.width,
+                                                     source.height);
+        for (size_t y = 0; y < source.height; ++y) {
+          std::copy_n(pixels.row(source.y + y) + source.x, source.width,
+                      a.row(y));
+        }
+
+        for (int k = 1; k <= depth; ++k) {
+          Rect step = expand_rect(tile, (depth - k) * radius, width, height);
+          for (size_t y = step.y; y < step.y + step.height; ++y) {
+            float *row = b.row(y - source.y);
+            for (size_t x = step.x; x < step.x + step.width; ++x) {
+              row[x - source.x] =
+                  kernel_func(a, x - source.x, y - source.y);
+            }
+          }
+          std::swap(a, b);
+        }
+
+        for (size_t y = 0; y < tile.height; ++y) {
+          const float *last =
+              a.row(tile.y - source.y + y) + (tile.x - source.x);
+          std::copy_n(last, tile.width, scratch.row(tile.y + y) + tile.x);
+        }
+      }
+    });
+
+    std::swap(pixels, scratch);
+    done += depth;
+    if (progress) {
+      progress(done - 1);
+    }
+  }
+}
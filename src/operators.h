@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+#include "image_buffer.h"
+#include "linear_filter.h"
+
+// The tunable parameters of the stencil stages, set at run time through
+// set_option or a config file. Kernels for radii of 1, 3 and 9 are
+// specialised at compile time (see with_radius); other radii run generic
+// code that gives the same results.
+struct StageParameters {
+  // The number of denoise (dialate) passes applied to the mask, and their
+  // window radius.
+  int denoise_count = 8;
+  int denoise_radius = 9;
+  // The number of blur passes after edge detection, and their radius.
+  int blur_count = 20;
+  int blur_radius = 3;
+  // Pixels within this distance of the threshold are marked.
+  int certainty = 5;
+};
+
+// The largest denoise radius dialate computes exactly (see check_parameters).
+constexpr int MAX_DENOISE_RADIUS = 127;
+
+// Throws std::invalid_argument unless every count and radius is positive, the
+// denoise radius is at most MAX_DENOISE_RADIUS and the certainty is at most
+// 256.
+void check_parameters(const StageParameters &parameters);
+
+// A radius fixed at compile time, so loops over a window have constant trip
+// counts and unroll.
+template <int R> struct FixedRadius {
+  constexpr operator int() const { return R; }
+};
+
+// A radius only known at run time.
+struct RuntimeRadius {
+  int value;
+  operator int() const { return value; }
+};
+
+// Calls `body` with `radius` as a FixedRadius if it is one of the specialised
+// radii, or as a RuntimeRadius otherwise. A kernel written as a generic
+// lambda over its radius is thereby instantiated once per specialised radius
+// plus once generically, and the right instance is picked at run time.
+template <typename Body> decltype(auto) with_radius(int radius, Body &&body) {
+  switch (radius) {
+  case 1:
+    return body(FixedRadius<1>());
+  case 3:
+    return body(FixedRadius<3>());
+  case 9:
+    return body(FixedRadius<9>());
+  default:
+    return body(RuntimeRadius{radius});
+  }
+}
+
+constexpr int SOBEL_X[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
+constexpr int SOBEL_Y[3][3] = {{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}};
+
+// A kernel computes one output pixel at (x, y) from its input view. The view's
+// edges are treated as the image edges.
+using KernelFunc = std::function<float(ImageView<const float>, int, int)>;
+
+// A singular application of the sobel kernel on a pixel at (x, y)
+float sobel_operator(ImageView<const float> input, int x, int y);
+
+// Averages the values of all the pixels within `radius` around the pixel at
+// (x, y)
+float blur_operator(ImageView<const float> input, int x, int y, int radius);
+
+// blur_operator with a fixed radius, specialised for it where possible.
+KernelFunc blur_kernel(int radius);
+
+// blur_operator followed by sobel_operator's two gradients, each collapsed
+// into one separable filter: the sum of their absolute responses
+// (apply_separable_abs_sum) is sobel_operator of blur_operator, edges
+// included, up to float rounding.
+std::vector<SeparableFilter> blurred_sobel_filters(int blur_radius);
+
+// Averages the pixels within `radius` of a non-zero pixel at (x, y); zero
+// pixels stay zero.
+float dialate_operator(ImageView<const float> input, int x, int y,
+                       int radius);
+
+// dialate_operator with a fixed radius, specialised for it where possible.
+KernelFunc dialate_kernel(int radius);
+
+// Applies a kernel across multiple load-balanced threads, writing every pixel
+// of `output`. The views must have the same size and must not overlap.
+void apply_kernel(ImageView<const float> input, ImageView<float> output,
+                  KernelFunc kernel_func);
+
+// As above, but only computes the pixels of `output` inside `region`; the rest
+// are left untouched.
+void apply_kernel(ImageView<const float> input, ImageView<float> output,
+                  KernelFunc kernel_func, const Rect &region);
+
+// Temporal blocking for iterated stencils. With depth > 1, apply_kernel_n
+// advances each tile by `depth` iterations before moving on, so a group of
+// iterations costs one trip through memory instead of `depth`.
+struct BlockingOptions {
+  // Iterations applied per tile before synchronising (1 disables blocking).
+  int depth = 1;
+  // Edge length of the output tiles, in pixels.
+  size_t tile_size = 256;
+};
+
+// Applies `kernel_func`, a stencil reading at most `radius` pixels away,
+// `count` times in a row. Only the pixels of `region` in the final result are
+// computed (and the halo each earlier pass needs for them), so `pixels` must
+// be valid within count * radius of `region`. `scratch` is a second buffer of
+// the same size; on return `pixels` holds the result. `progress` is called
+// after each pass, or each group of passes when blocking.
+//
+// When blocking, each tile copies its input grown by depth * radius into a
+// buffer of the worker running it and runs the group's iterations there on a
+// shrinking (trapezoidal) region. The halo is recomputed by neighbouring
+// tiles, which costs some redundant work but gives results identical to the
+// plain loop.
+void apply_kernel_n(ImageBuffer<float> &pixels, ImageBuffer<float> &scratch,
+                    KernelFunc kernel_func, int radius, int count,
+                    const Rect &region, const BlockingOptions &blocking = {},
+                    const std::function<void(int)> &progress = nullptr);
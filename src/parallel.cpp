@@ -0,0 +1,305 @@
+#include "parallel.h"
+
+#include <sched.h>
+#include <time.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cpu_budget.h"
+
+namespace {
+
+// Tasks each thread's chunk is split into when stealing. Enough for a thread
+// that finishes early to find work, few enough that the deque locks are
+// negligible next to the tasks.
+constexpr size_t TASKS_PER_THREAD = 8;
+
+thread_local ParallelContext *current_context = nullptr;
+
+// CPU time of the calling thread, so that busy time is not inflated by
+// threads being descheduled when the machine is oversubscribed.
+double thread_cpu_seconds() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+struct TaskDeque {
+  std::mutex lock;
+  std::deque<std::pair<size_t, size_t>> tasks;
+};
+
+// Takes a task from the front of the thread's own deque, or failing that
+// from the back of another's.
+bool next_task(std::vector<TaskDeque> &deques, size_t thread_idx,
+               std::pair<size_t, size_t> &task) {
+  {
+    TaskDeque &own = deques[thread_idx];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = own.tasks.front();
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < deques.size(); ++i) {
+    TaskDeque &victim = deques[(thread_idx + i) % deques.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.back();
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+// Restricts the calling thread to one CPU of the affinity mask, or with
+// `pin` false releases it to the whole mask again. Best effort: an unpinned
+// worker still computes the right result.
+void pin_thread(size_t thread_idx, bool pin = true) {
+  const std::vector<int> &cpus = affinity_cpus();
+  if (cpus.empty()) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pin) {
+    int cpu = cpus[thread_idx % cpus.size()];
+    if (cpu >= CPU_SETSIZE) {
+      return;
+    }
+    CPU_SET(cpu, &set);
+  } else {
+    for (int cpu : cpus) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+  }
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+// Whether the calling thread is one of WorkerPool's workers.
+thread_local bool in_worker = false;
+
+// The process's parallel_for workers. They are started on first use, one per
+// CPU of the budget (more if a call asks for more threads), and then wait
+// for work, so a loop costs a wake-up instead of thread creation, and worker
+// i keeps its pinning and thread-locals from one loop to the next. One call
+// uses the pool at a time.
+class WorkerPool {
+public:
+  static WorkerPool &instance() {
+    static WorkerPool pool;
+    return pool;
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Runs job(i) on workers 0 to count - 1 and waits for them, or returns
+  // false straight away if the pool is busy with another call (or the caller
+  // is a worker itself).
+  bool try_run(size_t count, bool pin,
+               const std::function<void(size_t)> &job) {
+    if (in_worker) {
+      return false;
+    }
+    std::unique_lock<std::mutex> running(run_lock_, std::try_to_lock);
+    if (!running) {
+      return false;
+    }
+
+    std::unique_lock<std::mutex> guard(lock_);
+    while (workers_.size() < count) {
+      size_t worker_idx = workers_.size();
+      workers_.emplace_back([this, worker_idx]() { work(worker_idx); });
+    }
+    job_ = &job;
+    job_count_ = count;
+    pin_ = pin;
+    remaining_ = count;
+    ++generation_;
+    wake_.notify_all();
+    done_.wait(guard, [&]() { return remaining_ == 0; });
+    job_ = nullptr;
+    return true;
+  }
+
+private:
+  WorkerPool() { workers_.reserve(cpu_budget()); }
+
+  void work(size_t worker_idx) {
+    in_worker = true;
+    bool pinned = false;
+    size_t seen = 0;
+    std::unique_lock<std::mutex> guard(lock_);
+    while (true) {
+      wake_.wait(guard, [&]() { return stop_ || generation_ != seen; });
+      if (stop_) {
+        return;
+      }
+      // A worker that slept through a generation was not part of it: a
+      // call only returns once all of its workers have finished.
+      seen = generation_;
+      if (worker_idx >= job_count_) {
+        continue;
+      }
+      const std::function<void(size_t)> &job = *job_;
+      bool pin = pin_;
+      guard.unlock();
+
+      if (pin != pinned) {
+        pin_thread(worker_idx, pin);
+        pinned = pin;
+      }
+      job(worker_idx);
+
+      guard.lock();
+      if (--remaining_ == 0) {
+        done_.notify_all();
+      }
+    }
+  }
+
+  // Held for the whole of a call.
+  std::mutex run_lock_;
+  std::mutex lock_;
+  std::condition_variable wake_, done_;
+  std::vector<std::thread> workers_;
+  const std::function<void(size_t)> *job_ = nullptr;
+  size_t job_count_ = 0;
+  bool pin_ = false;
+  size_t remaining_ = 0;
+  size_t generation_ = 0;
+  bool stop_ = false;
+};
+
+} // namespace
+
+Schedule parse_schedule(const std::string &name) {
+  if (name == "static") {
+    return Schedule::STATIC;
+  }
+  if (name == "stealing") {
+    return Schedule::STEALING;
+  }
+  throw std::invalid_argument("unknown schedule " + name);
+}
+
+ParallelContext::ParallelContext(const ParallelOptions &options)
+    : options_(options), previous_(current_context) {
+  current_context = this;
+}
+
+ParallelContext::~ParallelContext() { current_context = previous_; }
+
+double ParallelContext::imbalance() const {
+  return mean_busy_ > 0 ? max_busy_ / mean_busy_ : 0.0;
+}
+
+void ParallelContext::record(const double *busy_seconds, size_t thread_count) {
+  double max = 0, sum = 0;
+  for (size_t i = 0; i < thread_count; ++i) {
+    max = std::max(max, busy_seconds[i]);
+    sum += busy_seconds[i];
+  }
+  max_busy_ += max;
+  mean_busy_ += sum / thread_count;
+}
+
+ParallelContext *ParallelContext::current() { return current_context; }
+
+void parallel_for(size_t count,
+                  const std::function<void(size_t, size_t)> &body) {
+  parallel_for(count, 1, body);
+}
+
+void parallel_for(size_t count, size_t min_grain,
+                  const std::function<void(size_t, size_t)> &body) {
+  if (count == 0) {
+    return;
+  }
+  min_grain = std::max<size_t>(min_grain, 1);
+
+  ParallelContext *context = ParallelContext::current();
+  ParallelOptions options = context ? context->options() : ParallelOptions();
+  Schedule schedule = options.schedule;
+
+  size_t max_thread_count = options.threads ? options.threads : cpu_budget();
+  size_t thread_count =
+      std::min(max_thread_count, std::max<size_t>(count / min_grain, 1));
+  std::vector<double> busy(thread_count);
+
+  size_t chunk_size = count / thread_count;
+  auto chunk = [&](size_t thread_idx) {
+    size_t chunk_start = chunk_size * thread_idx;
+    size_t chunk_end =
+        (thread_idx == thread_count - 1) ? count : chunk_start + chunk_size;
+    return std::make_pair(chunk_start, chunk_end);
+  };
+
+  // The initial split is the static one, so stealing only moves work that
+  // its owner has not reached yet.
+  std::vector<TaskDeque> deques(schedule == Schedule::STEALING ? thread_count
+                                                               : 0);
+  size_t grain = std::max(chunk_size / TASKS_PER_THREAD, min_grain);
+  for (size_t thread_idx = 0; thread_idx < deques.size(); ++thread_idx) {
+    std::pair<size_t, size_t> range = chunk(thread_idx);
+    for (size_t begin = range.first; begin < range.second; begin += grain) {
+      deques[thread_idx].tasks.emplace_back(
+          begin, std::min(begin + grain, range.second));
+    }
+  }
+
+  std::function<void(size_t)> job = [&](size_t thread_idx) {
+    double start = thread_cpu_seconds();
+    if (schedule == Schedule::STEALING) {
+      std::pair<size_t, size_t> task;
+      while (next_task(deques, thread_idx, task)) {
+        body(task.first, task.second);
+      }
+    } else {
+      std::pair<size_t, size_t> range = chunk(thread_idx);
+      body(range.first, range.second);
+    }
+    busy[thread_idx] = thread_cpu_seconds() - start;
+  };
+
+  // While the pool is taken, by another thread's loop or by the loop this
+  // one is nested in, the call gets threads of its own for its duration.
+  if (!WorkerPool::instance().try_run(thread_count, options.pin, job)) {
+    std::vector<std::thread> threads;
+    for (size_t thread_idx = 0; thread_idx < thread_count; ++thread_idx) {
+      threads.emplace_back([&, thread_idx]() {
+        if (options.pin) {
+          pin_thread(thread_idx);
+        }
+        job(thread_idx);
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+  if (context) {
+    context->record(busy.data(), thread_count);
+  }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+// How parallel_for hands out its work.
+enum class Schedule {
+  // One contiguous chunk per thread. Cheapest, but the slowest chunk sets
+  // the pace when the cost per item varies (e.g. dialate, which skips zero
+  // pixels).
+  STATIC,
+  // Each thread starts with its contiguous chunk split into small tasks in
+  // its own deque, takes tasks from the front, and once it runs dry steals
+  // from the back of the other threads' deques.
+  STEALING,
+};
+
+// Parses "static" or "stealing".
+Schedule parse_schedule(const std::string &name);
+
+struct ParallelOptions {
+  Schedule schedule = Schedule::STEALING;
+  // Threads per parallel loop, or 0 for the process's CPU budget (see
+  // cpu_budget.h).
+  size_t threads = 0;
+  // Pin worker i of every loop to the i-th CPU of the affinity mask, so the
+  // same rows are always processed from the same core and NUMA node. Workers
+  // stay pinned until a loop without pinning runs on them.
+  bool pin = false;
+};
+
+// Scheduling and load-balance statistics for the parallel_for calls issued
+// from the thread that created the context, for as long as it is alive.
+// Contexts nest; without one, parallel_for uses the default ParallelOptions.
+class ParallelContext {
+public:
+  explicit ParallelContext(const ParallelOptions &options);
+  ~ParallelContext();
+  ParallelContext(const ParallelContext &) = delete;
+  ParallelContext &operator=(const ParallelContext &) = delete;
+
+  const ParallelOptions &options() const { return options_; }
+
+  // The summed busy (CPU) time of the busiest thread of each call over the
+  // summed mean busy time, so 1 is perfectly balanced and T means one thread
+  // did all the work of T. Zero if no parallel_for has run.
+  double imbalance() const;
+
+  // Records one call's per-thread busy times.
+  void record(const double *busy_seconds, size_t thread_count);
+
+  // The innermost context of the calling thread, or null.
+  static ParallelContext *current();
+
+private:
+  ParallelOptions options_;
+  double max_busy_ = 0;
+  double mean_busy_ = 0;
+  ParallelContext *previous_;
+};
+
+// Runs `body(begin, end)` over subranges covering [0, count) on up to
+// ParallelOptions::threads threads, returning once all are done. `body` may
+// be called several times per thread (see Schedule), so per-thread setup
+// inside it is per call.
+//
+// The threads come from a persistent pool, started on first use with one
+// worker per CPU of cpu_budget() and grown if a call asks for more, so
+// thread-locals set up by a body persist across calls. A call made while the
+// pool is busy (from another thread, or from inside a body) runs on threads
+// started for it instead.
+void parallel_for(size_t count,
+                  const std::function<void(size_t, size_t)> &body);
+
+// As above, but no subrange is shorter than `min_grain` (except the last of
+// a thread, or all of `count` if it is smaller), for bodies with a fixed
+// setup cost per call, such as priming a sliding window.
+void parallel_for(size_t count, size_t min_grain,
+                  const std::function<void(size_t, size_t)> &body);
@@ -0,0 +1,133 @@
+#include "perf_counters.h"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace {
+
+int open_event(PerfEvent event) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  switch (event) {
+  case PERF_CYCLES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case PERF_INSTRUCTIONS:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case PERF_LLC_MISSES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  case PERF_DTLB_MISSES:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  case PERF_BRANCH_MISSES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+    break;
+  default:
+    return -1;
+  }
+
+  // Fails with EACCES/ENOENT/EOPNOTSUPP when perf_event_paranoid, seccomp or a
+  // virtualised PMU forbids it; the event is then simply skipped.
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+bool read_raw(int fd, uint64_t (&values)[3]) {
+  return read(fd, values, sizeof(values)) ==
+         static_cast<ssize_t>(sizeof(values));
+}
+
+} // namespace
+#endif
+
+PerfCounters::PerfCounters() {
+#ifdef __linux__
+  for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+    fds[i] = open_event(static_cast<PerfEvent>(i));
+  }
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (int fd : fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+#endif
+}
+
+bool PerfCounters::available() const {
+  for (int fd : fds) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PerfCounters::start() {
+#ifdef __linux__
+  for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+    if (fds[i] >= 0) {
+      read_raw(fds[i], start_values[i]);
+      ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif
+}
+
+PerfSample PerfCounters::stop() {
+  PerfSample sample;
+#ifdef __linux__
+  for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+    if (fds[i] < 0) {
+      continue;
+    }
+    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t end_values[3];
+    if (!read_raw(fds[i], end_values)) {
+      continue;
+    }
+
+    // Scale up if the kernel had to multiplex the counter.
+    uint64_t value = end_values[0] - start_values[i][0];
+    uint64_t enabled = end_values[1] - start_values[i][1];
+    uint64_t running = end_values[2] - start_values[i][2];
+    if (running == 0) {
+      continue;
+    }
+    if (running < enabled) {
+      value = static_cast<uint64_t>(static_cast<double>(value) *
+                                    static_cast<double>(enabled) / running);
+    }
+    sample.valid[i] = true;
+    sample.values[i] = value;
+  }
+#endif
+  return sample;
+}
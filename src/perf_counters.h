@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+// The hardware events sampled around each pipeline stage.
+enum PerfEvent {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_EVENT_COUNT
+};
+
+constexpr const char *PERF_EVENT_NAMES[PERF_EVENT_COUNT] = {
+    "cycles", "instructions", "llc-misses", "dtlb-misses", "branch-misses"};
+
+// Counter values for one measured interval. An event that could not be opened
+// (or never got scheduled on the PMU) is marked invalid rather than reported
+// as zero.
+struct PerfSample {
+  uint64_t values[PERF_EVENT_COUNT] = {};
+  bool valid[PERF_EVENT_COUNT] = {};
+
+  bool any_valid() const {
+    for (bool v : valid) {
+      if (v) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// A set of perf_event counters for the calling thread and every thread it
+// spawns afterwards. Worker threads are created per stage and joined before
+// the stage ends, so inherited counts are folded back into the parent by the
+// time stop() reads them.
+//
+// Each event is opened on its own fd instead of as a group, so a PMU or
+// container that only exposes some of them still reports the rest.
+class PerfCounters {
+public:
+  PerfCounters();
+  ~PerfCounters();
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  // True if at least one counter could be opened.
+  bool available() const;
+
+  void start();
+  PerfSample stop();
+
+private:
+  int fds[PERF_EVENT_COUNT] = {-1, -1, -1, -1, -1};
+  // value, time enabled and time running at start()
+  uint64_t start_values[PERF_EVENT_COUNT][3] = {};
+};
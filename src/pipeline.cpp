@@ -0,0 +1,642 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb/stb_image_write.h"
+
+#include "memory_usage.h"
+#include "numa.h"
+#include "operators.h"
+#include "parallel.h"
+#include "smoothing.h"
+#include "stages.h"
+
+namespace {
+
+bool parse_bool(const std::string &name, const std::string &value) {
+  if (value == "1" || value == "true" || value == "on" || value == "yes") {
+    return true;
+  }
+  if (value == "0" || value == "false" || value == "off" || value == "no") {
+    return false;
+  }
+  throw std::invalid_argument("option " + name + " expects a boolean, got " +
+                              value);
+}
+
+int parse_count(const std::string &name, const std::string &value) {
+  size_t used = 0;
+  int count = 0;
+  try {
+    count = std::stoi(value, &used);
+  } catch (const std::exception &) {
+    used = 0;
+  }
+  if (used != value.size() || count < 1) {
+    throw std::invalid_argument("option " + name +
+                                " expects a positive integer, got " + value);
+  }
+  return count;
+}
+
+} // namespace
+
+EdgeFilter parse_edge_filter(const std::string &name) {
+  if (name == "stencil") {
+    return EdgeFilter::STENCIL;
+  }
+  if (name == "separable") {
+    return EdgeFilter::SEPARABLE;
+  }
+  throw std::invalid_argument("unknown edge filter " + name);
+}
+
+void set_option(PipelineOptions &options, const std::string &name,
+                const std::string &value) {
+  if (name == "perf") {
+    options.perf_counters = parse_bool(name, value);
+  } else if (name == "denoise-count") {
+    options.parameters.denoise_count = parse_count(name, value);
+  } else if (name == "denoise-radius") {
+    options.parameters.denoise_radius = parse_count(name, value);
+  } else if (name == "blur-count") {
+    options.parameters.blur_count = parse_count(name, value);
+  } else if (name == "blur-radius") {
+    options.parameters.blur_radius = parse_count(name, value);
+  } else if (name == "certainty") {
+    options.parameters.certainty = parse_count(name, value);
+  } else if (name == "edges") {
+    options.edges = parse_edge_filter(value);
+  } else if (name == "smoothing") {
+    options.smoothing = parse_smoothing_mode(value);
+  } else if (name == "convolution") {
+    options.convolution = parse_convolution_backend(value);
+  } else if (name == "dialate") {
+    options.dialate_engine = parse_dialate_engine(value);
+  } else if (name == "temporal-depth") {
+    options.blocking.depth = parse_count(name, value);
+  } else if (name == "temporal-tile") {
+    options.blocking.tile_size = parse_count(name, value);
+  } else if (name == "schedule") {
+    options.parallel.schedule = parse_schedule(value);
+  } else if (name == "threads") {
+    options.parallel.threads =
+        value == "auto" ? 0 : static_cast<size_t>(parse_count(name, value));
+  } else if (name == "huge-pages") {
+    options.huge_pages = parse_huge_pages(value);
+  } else if (name == "buffer-pool") {
+    options.buffer_pool = parse_bool(name, value);
+  } else if (name == "buffer-pool-size") {
+    options.buffer_pool_megabytes =
+        static_cast<size_t>(parse_count(name, value));
+  } else if (name == "pin") {
+    options.parallel.pin = parse_bool(name, value);
+  } else if (name == "cache-dir") {
+    options.cache_dir = value;
+  } else if (name == "cache-size") {
+    options.cache_megabytes = static_cast<size_t>(parse_count(name, value));
+  } else if (name == "verbose") {
+    options.verbose = parse_bool(name, value);
+  } else {
+    throw std::invalid_argument("unknown option " + name);
+  }
+}
+
+void load_options(PipelineOptions &options, const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::runtime_error("unable to read config file " + path);
+  }
+
+  auto trim = [](const std::string &text) {
+    size_t first = text.find_first_not_of(" \t\r");
+    size_t last = text.find_last_not_of(" \t\r");
+    return first == std::string::npos ? std::string()
+                                      : text.substr(first, last - first + 1);
+  };
+
+  PipelineOptions loaded = options;
+  std::string line;
+  for (int number = 1; std::getline(file, line); ++number) {
+    line = trim(line.substr(0, line.find('#')));
+    if (line.empty()) {
+      continue;
+    }
+    std::string where = path + ":" + std::to_string(number);
+    size_t split = line.find('=');
+    if (split == std::string::npos) {
+      throw std::invalid_argument(where + ": expected name = value");
+    }
+    try {
+      set_option(loaded, trim(line.substr(0, split)),
+                 trim(line.substr(split + 1)));
+    } catch (const std::invalid_argument &error) {
+      throw std::invalid_argument(where + ": " + error.what());
+    }
+  }
+  options = loaded;
+}
+
+std::map<std::string, double> PipelineMetrics::values() const {
+  std::map<std::string, double> values;
+  values["threshold"] = threshold;
+  values["dialate.iterations"] = dialate_iterations;
+  values["pixels"] = static_cast<double>(pixel_count);
+  values["threads"] = static_cast<double>(threads);
+  values["rss.peak-bytes"] = static_cast<double>(peak_rss_bytes);
+  values["pool.hits"] = static_cast<double>(pool_hits);
+  values["pool.misses"] = static_cast<double>(pool_misses);
+  if (pool_hits + pool_misses > 0) {
+    values["pool.hit-rate"] =
+        static_cast<double>(pool_hits) / (pool_hits + pool_misses);
+  }
+  if (cache_hits + cache_misses > 0) {
+    values["cache.hits"] = static_cast<double>(cache_hits);
+    values["cache.misses"] = static_cast<double>(cache_misses);
+  }
+
+  double total = 0;
+  for (const StageMetrics &stage : stages) {
+    total += stage.seconds;
+    values[stage.name + ".seconds"] = stage.seconds;
+    if (stage.imbalance > 0) {
+      values[stage.name + ".imbalance"] = stage.imbalance;
+    }
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+      if (stage.counters.valid[i]) {
+        values[stage.name + "." + PERF_EVENT_NAMES[i]] =
+            static_cast<double>(stage.counters.values[i]);
+      }
+    }
+  }
+  values["total.seconds"] = total;
+
+  return values;
+}
+
+void reduce_channels(ImageView<const unsigned char> input, int channels,
+                     ImageView<float> output) {
+  for (size_t y = 0; y < input.height; ++y) {
+    const unsigned char *row = input.row(y);
+    float *pixel_row = output.row(y);
+    for (size_t x = 0; x < input.width; ++x) {
+      const unsigned char *pixel = row + x * channels;
+      float average = 0;
+      if (channels >= 3) {
+        average = (pixel[0] + pixel[1] + pixel[2]) / 3.0f;
+      }
+      pixel_row[x] = average;
+    }
+  }
+}
+
+unsigned char select_threshold(ImageView<const float> pixels,
+                               const Rect &region) {
+  std::unordered_map<unsigned char, unsigned int> pixel_frequency;
+  for (size_t y = region.y; y < region.y + region.height; ++y) {
+    const float *row = pixels.row(y);
+    for (size_t x = region.x; x < region.x + region.width; ++x) {
+      unsigned char pixel_value = row[x];
+      if (pixel_value < 1 || pixel_value > 50) {
+        continue;
+      }
+
+      ++pixel_frequency[pixel_value];
+    }
+  }
+
+  if (pixel_frequency.empty()) {
+    throw std::runtime_error("no pixels in the threshold range");
+  }
+
+  return std::max_element(
+             pixel_frequency.begin(), pixel_frequency.end(),
+             [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+               return a.second < b.second;
+             })
+      ->first;
+}
+
+void apply_threshold(ImageView<const float> pixels, unsigned char threshold,
+                     int certainty, const Rect &region,
+                     ImageView<unsigned char> mask,
+                     OccupancyMap *occupancy) {
+  if (!occupancy) {
+    for (size_t y = region.y; y < region.y + region.height; ++y) {
+      const float *row = pixels.row(y);
+      unsigned char *mask_row = mask.row(y);
+      for (size_t x = region.x; x < region.x + region.width; ++x) {
+        unsigned char dist =
+            std::abs(static_cast<unsigned char>(row[x]) - threshold);
+        mask_row[x] = dist < certainty ? 255 : 0;
+      }
+    }
+    return;
+  }
+
+  // Same loop, walking each row tile by tile to count the set pixels.
+  *occupancy = make_occupancy(region);
+  std::vector<size_t> set(occupancy->tiles.size());
+  for (size_t y = region.y; y < region.y + region.height; ++y) {
+    const float *row = pixels.row(y);
+    unsigned char *mask_row = mask.row(y);
+    size_t *tile_set =
+        &set[(y - region.y) / OCCUPANCY_TILE * occupancy->tiles_x];
+    for (size_t x0 = region.x; x0 < region.x + region.width;
+         x0 += OCCUPANCY_TILE, ++tile_set) {
+      size_t x_end = std::min(x0 + OCCUPANCY_TILE, region.x + region.width);
+      size_t count = 0;
+      for (size_t x = x0; x < x_end; ++x) {
+        unsigned char dist =
+            std::abs(static_cast<unsigned char>(row[x]) - threshold);
+        mask_row[x] = dist < certainty ? 255 : 0;
+        count += dist < certainty;
+      }
+      *tile_set += count;
+    }
+  }
+  for (size_t t = 0; t < set.size(); ++t) {
+    occupancy->tiles[t] = classify_tile(set[t], occupancy->tile_rect(t).area());
+  }
+}
+
+Rect parse_rect(const std::string &text) {
+  Rect rect;
+  char trailing;
+  if (std::sscanf(text.c_str(), "%zu,%zu,%zu,%zu%c", &rect.x, &rect.y,
+                  &rect.width, &rect.height, &trailing) != 4) {
+    throw std::invalid_argument("expected x,y,width,height, got " + text);
+  }
+  return rect;
+}
+
+void run_pipeline(ImageView<const unsigned char> input, int channels,
+                  ImageView<unsigned char> output,
+                  const PipelineOptions &options, PipelineMetrics &metrics) {
+  run_pipeline(input, channels, Rect{0, 0, input.width, input.height}, output,
+               options, metrics);
+}
+
+void run_pipeline(ImageView<const unsigned char> input, int channels,
+                  const Rect &roi, ImageView<unsigned char> output,
+                  const PipelineOptions &options, PipelineMetrics &metrics,
+                  const std::function<void()> &input_done) {
+  if (input.empty() || roi.area() == 0) {
+    throw std::invalid_argument("empty image");
+  }
+  if (roi.x + roi.width > input.width || roi.y + roi.height > input.height) {
+    throw std::invalid_argument("region of interest exceeds image bounds");
+  }
+  if (output.width != roi.width || output.height != roi.height) {
+    throw std::invalid_argument("output size does not match input");
+  }
+
+  const StageParameters &parameters = options.parameters;
+  check_parameters(parameters);
+
+  StageRegions regions =
+      stage_regions(roi, input.width, input.height, parameters);
+  StageRunner runner(options, metrics);
+  metrics.pixel_count = roi.area();
+
+  StageCache *cache = runner.cache();
+  StageKeys keys;
+  bool have_smoothed = false, have_mask = false;
+  if (cache) {
+    runner.measure("cache", [&]() {
+      keys = stage_keys(hash_stage_input(input, channels, regions), regions,
+                        options, parameters);
+      have_mask = load_mask(*cache, keys.mask, output, metrics.threshold,
+                            metrics.dialate_iterations);
+    });
+  }
+
+  if (have_mask) {
+    if (input_done) {
+      input_done();
+    }
+    if (options.verbose) {
+      std::cout << "-loaded mask from cache" << std::endl;
+    }
+    runner.finish();
+    return;
+  }
+
+  // Float stages ping-pong between two buffers; `pixels` always holds the
+  // latest result. Its first writer (reduce) is serial, so its pages are
+  // placed up front; `scratch` is first written by a row-parallel kernel.
+  const Rect &outer = regions.outer;
+  ImageBuffer<float> pixels(outer.width, outer.height),
+      scratch(outer.width, outer.height);
+  first_touch(pixels);
+
+  if (cache) {
+    runner.measure("cache-load", [&]() {
+      have_smoothed = load_smoothed(*cache, keys.smoothed, regions, pixels);
+    });
+  }
+  if (have_smoothed) {
+    if (input_done) {
+      input_done();
+    }
+    if (options.verbose) {
+      std::cout << "-loaded smoothed image from cache" << std::endl;
+    }
+  } else {
+    reduce_stage(runner, input, channels, regions, pixels);
+    if (input_done) {
+      input_done();
+    }
+    edge_stage(runner, regions, parameters, pixels, scratch);
+    smooth_stage(runner, regions, parameters, pixels, scratch);
+  }
+
+  ImageBuffer<unsigned char> mask(outer.width, outer.height);
+  first_touch(mask);
+  OccupancyMap occupancy;
+  metrics.threshold =
+      threshold_stage(runner, regions, parameters, pixels, mask, occupancy);
+  // The final mask goes straight into the caller's memory.
+  metrics.dialate_iterations =
+      dialate_stage(runner, regions, parameters, mask, occupancy, output);
+
+  if (cache) {
+    runner.measure("cache-store", [&]() {
+      if (!have_smoothed) {
+        store_smoothed(*cache, keys.smoothed, regions, pixels);
+      }
+      store_mask(*cache, keys.mask, output, metrics.threshold,
+                 metrics.dialate_iterations);
+    });
+  }
+
+  runner.finish();
+}
+
+void print_stage_report(const PipelineMetrics &metrics) {
+  size_t pixel_count = metrics.pixel_count;
+  auto per_pixel = [&](const PerfSample &sample, PerfEvent event) {
+    std::ostringstream out;
+    if (sample.valid[event]) {
+      out << std::fixed << std::setprecision(3)
+          << static_cast<double>(sample.values[event]) / pixel_count;
+    } else {
+      out << "n/a";
+    }
+    return out.str();
+  };
+
+  std::cout << std::left << std::setw(11) << "-stage" << std::right
+            << std::setw(10) << "ms" << std::setw(8) << "IPC"
+            << std::setw(12) << "cycles/px" << std::setw(12) << "LLC/px"
+            << std::setw(12) << "dTLB/px" << std::setw(12) << "branch/px"
+            << std::setw(8) << "imbal" << std::endl;
+
+  for (const StageMetrics &stage : metrics.stages) {
+    const PerfSample &sample = stage.counters;
+
+    std::ostringstream ipc;
+    if (sample.valid[PERF_CYCLES] && sample.valid[PERF_INSTRUCTIONS] &&
+        sample.values[PERF_CYCLES] > 0) {
+      ipc << std::fixed << std::setprecision(2)
+          << static_cast<double>(sample.values[PERF_INSTRUCTIONS]) /
+                 sample.values[PERF_CYCLES];
+    } else {
+      ipc << "n/a";
+    }
+
+    // Single-threaded stages have nothing to balance.
+    std::ostringstream imbalance;
+    if (stage.imbalance > 0) {
+      imbalance << std::fixed << std::setprecision(2) << stage.imbalance;
+    } else {
+      imbalance << "-";
+    }
+
+    std::cout << std::left << std::setw(11) << ("-" + stage.name)
+              << std::right << std::setw(10) << std::fixed
+              << std::setprecision(2) << stage.seconds * 1000.0
+              << std::setw(8) << ipc.str() << std::setw(12)
+              << per_pixel(sample, PERF_CYCLES) << std::setw(12)
+              << per_pixel(sample, PERF_LLC_MISSES) << std::setw(12)
+              << per_pixel(sample, PERF_DTLB_MISSES) << std::setw(12)
+              << per_pixel(sample, PERF_BRANCH_MISSES) << std::setw(8)
+              << imbalance.str() << std::endl;
+  }
+
+  if (metrics.peak_rss_bytes > 0) {
+    std::cout << "-peak RSS: " << std::fixed << std::setprecision(1)
+              << metrics.peak_rss_bytes / 1048576.0 << " MB" << std::endl;
+  }
+
+  size_t allocations = metrics.pool_hits + metrics.pool_misses;
+  if (allocations > 0) {
+    std::cout << "-buffer pool: " << metrics.pool_hits << " of " << allocations
+              << " buffers reused" << std::endl;
+  }
+
+  size_t lookups = metrics.cache_hits + metrics.cache_misses;
+  if (lookups > 0) {
+    std::cout << "-stage cache: " << metrics.cache_hits << " of " << lookups
+              << " lookups hit" << std::endl;
+  }
+  std::cout << std::defaultfloat << std::setprecision(6);
+}
+
+void write_mask(const std::string &path, ImageView<const unsigned char> mask) {
+  // Written beside the final name and renamed over it, so an interrupted
+  // run never leaves a truncated mask that looks up to date.
+  std::string partial = path + ".partial";
+  if (!stbi_write_png(partial.c_str(), static_cast<int>(mask.width),
+                      static_cast<int>(mask.height), 1, mask.data,
+                      static_cast<int>(mask.stride)) ||
+      std::rename(partial.c_str(), path.c_str()) != 0) {
+    std::remove(partial.c_str());
+    throw std::runtime_error("unable to write " + path);
+  }
+}
+
+std::string region_output_path(const std::string &output_path, size_t index) {
+  std::string path = output_path;
+  size_t extension = path.rfind('.');
+  if (extension != std::string::npos &&
+      path.find('/', extension) != std::string::npos) {
+    extension = std::string::npos;
+  }
+  path.insert(extension == std::string::npos ? path.size() : extension,
+              "_roi" + std::to_string(index));
+  return path;
+}
+
+void process_image(const char *file_path, const char *output_path,
+                   const PipelineOptions &options,
+                   const std::vector<Rect> &regions) {
+  // Peak RSS then covers this image from decode to output.
+  reset_peak_rss();
+
+  int width, height, channels;
+  std::unique_ptr<unsigned char, void (*)(void *)> image(
+      stbi_load(file_path, &width, &height, &channels, 0), stbi_image_free);
+  if (!image) {
+    throw std::runtime_error("unable to load image");
+  }
+
+  if (options.verbose) {
+    std::cout << "-loaded image " << file_path << std::endl;
+  }
+
+  ImageView<const unsigned char> input(image.get(), width, height,
+                                       static_cast<size_t>(width) * channels);
+
+  std::vector<Rect> targets = regions;
+  if (targets.empty()) {
+    targets.push_back(Rect{0, 0, input.width, input.height});
+  }
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    const Rect &roi = targets[i];
+
+    std::string path = regions.empty() ? std::string(output_path)
+                                       : region_output_path(output_path, i);
+
+    // The decoded image is only read by the reduce stage, so once the last
+    // target has been reduced it is freed rather than kept alongside every
+    // later buffer.
+    ImageBuffer<unsigned char> output_image(roi.width, roi.height);
+    PipelineMetrics metrics;
+    run_pipeline(input, channels, roi, output_image.view(), options, metrics,
+                 [&]() {
+                   if (i + 1 == targets.size()) {
+                     image.reset();
+                   }
+                 });
+
+    if (options.perf_counters) {
+      print_stage_report(metrics);
+    }
+
+    if (options.verbose) {
+      std::cout << "-saving as " << path << std::endl;
+    }
+
+    write_mask(path, output_image.view());
+  }
+}
+
+void validate_smoothing(const char *file_path,
+                        const StageParameters &parameters) {
+  check_parameters(parameters);
+
+  int width, height, channels;
+  unsigned char *image = stbi_load(file_path, &width, &height, &channels, 0);
+  if (!image) {
+    throw std::runtime_error("unable to load image");
+  }
+
+  // The smoothing input: the edge map after reduce, blur and sobel.
+  ImageBuffer<float> edges(width, height), scratch(width, height);
+  ImageView<const unsigned char> input(image, width, height,
+                                       static_cast<size_t>(width) * channels);
+  reduce_channels(input, channels, edges.view());
+  stbi_image_free(image);
+  apply_kernel(edges.view(), scratch.view(),
+               blur_kernel(parameters.blur_radius));
+  apply_kernel(scratch.view(), edges.view(), sobel_operator);
+
+  Rect whole{0, 0, edges.width(), edges.height()};
+  auto run = [&](SmoothingMode mode, ConvolutionBackend convolution,
+                 double &seconds) {
+    ImageBuffer<float> pixels(width, height), spare(width, height);
+    for (size_t y = 0; y < edges.height(); ++y) {
+      std::copy_n(edges.row(y), width, pixels.row(y));
+    }
+    auto start = std::chrono::steady_clock::now();
+    smooth(pixels, spare, whole, mode, parameters, {}, convolution);
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+    return pixels;
+  };
+
+  // Threshold and pre-dialate mask of a smoothed image, for agreement.
+  auto threshold_mask = [&](const ImageBuffer<float> &smoothed,
+                            unsigned char &threshold) {
+    ImageBuffer<unsigned char> mask(width, height);
+    threshold = select_threshold(smoothed.view(), whole);
+    apply_threshold(smoothed.view(), threshold, parameters.certainty, whole,
+                    mask.view());
+    return mask;
+  };
+
+  double reference_seconds;
+  ImageBuffer<float> reference = run(
+      SmoothingMode::ITERATED, ConvolutionBackend::AUTO, reference_seconds);
+  unsigned char reference_threshold;
+  ImageBuffer<unsigned char> reference_mask =
+      threshold_mask(reference, reference_threshold);
+
+  std::cout << "-validating smoothing on " << file_path << " (iterated "
+            << std::fixed << std::setprecision(2) << reference_seconds * 1000.0
+            << " ms, t=" << static_cast<int>(reference_threshold) << ")"
+            << std::endl;
+  std::cout << std::left << std::setw(18) << "-mode" << std::right
+            << std::setw(10) << "ms" << std::setw(12) << "border max"
+            << std::setw(12) << "border avg" << std::setw(12) << "inner max"
+            << std::setw(12) << "inner avg" << std::setw(12) << "8-bit diff"
+            << std::setw(4) << "t" << std::setw(12) << "mask diff" << std::endl;
+
+  // The composite mode once per convolution backend.
+  std::vector<std::pair<SmoothingMode, ConvolutionBackend>> candidates = {
+      {SmoothingMode::COMPOSITE, ConvolutionBackend::DIRECT},
+      {SmoothingMode::COMPOSITE, ConvolutionBackend::FFT},
+      {SmoothingMode::RUNNING_SUM, ConvolutionBackend::AUTO},
+      {SmoothingMode::IIR, ConvolutionBackend::AUTO}};
+  for (const auto &candidate_mode : candidates) {
+    SmoothingMode mode = candidate_mode.first;
+    std::string label = std::string("-") + smoothing_mode_name(mode);
+    if (mode == SmoothingMode::COMPOSITE) {
+      label += "/";
+      label += convolution_backend_name(candidate_mode.second);
+    }
+    double seconds;
+    ImageBuffer<float> candidate = run(mode, candidate_mode.second, seconds);
+    SmoothingDeviation deviation =
+        compare_smoothing(reference.view(), candidate.view(),
+                          composite_radius(parameters));
+
+    unsigned char threshold;
+    ImageBuffer<unsigned char> mask = threshold_mask(candidate, threshold);
+    size_t mask_mismatch = 0;
+    for (size_t y = 0; y < mask.height(); ++y) {
+      for (size_t x = 0; x < mask.width(); ++x) {
+        mask_mismatch += mask.row(y)[x] != reference_mask.row(y)[x];
+      }
+    }
+
+    std::cout << std::left << std::setw(18) << label << std::right
+              << std::setprecision(2) << std::setw(10) << seconds * 1000.0
+              << std::setprecision(4) << std::setw(12) << deviation.border_max
+              << std::setw(12) << deviation.border_mean << std::setw(12)
+              << deviation.interior_max << std::setw(12)
+              << deviation.interior_mean << std::setw(11)
+              << deviation.byte_mismatch * 100.0 << "%" << std::setw(4)
+              << static_cast<int>(threshold) << std::setw(11)
+              << 100.0 * mask_mismatch / whole.area() << "%" << std::endl;
+  }
+  std::cout << std::defaultfloat << std::setprecision(6);
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "dialate.h"
+#include "image_buffer.h"
+#include "image_memory.h"
+#include "parallel.h"
+#include "perf_counters.h"
+#include "smoothing.h"
+
+// How the edge map (blur, then sobel) is computed.
+enum class EdgeFilter {
+  // blur_operator and sobel_operator as two stencil passes.
+  STENCIL,
+  // Both collapsed into two separable filters (blurred_sobel_filters) and
+  // applied in one pass, without the intermediate blurred image. Equal up to
+  // float rounding.
+  SEPARABLE,
+};
+
+// Parses "stencil" or "separable".
+EdgeFilter parse_edge_filter(const std::string &name);
+
+struct PipelineOptions {
+  // Sample hardware performance counters around each stage (perf).
+  bool perf_counters = false;
+  // Pass counts, radii and certainty of the stages (denoise-count,
+  // denoise-radius, blur-count, blur-radius, certainty).
+  StageParameters parameters;
+  // How the edge map is computed (edges).
+  EdgeFilter edges = EdgeFilter::STENCIL;
+  // How the blurs after edge detection are computed (smoothing).
+  SmoothingMode smoothing = SmoothingMode::ITERATED;
+  // Direct or FFT convolution for the composite smoothing (convolution).
+  ConvolutionBackend convolution = ConvolutionBackend::AUTO;
+  // Temporal blocking of the iterated blur passes (temporal-depth,
+  // temporal-tile).
+  BlockingOptions blocking;
+  // Which engine schedules the dialate passes (dialate).
+  DialateEngine dialate_engine = DialateEngine::SWEEP;
+  // Backing for large image buffers (huge-pages). Applies to the buffers of
+  // this run only, see HugePagesScope.
+  HugePages huge_pages = HugePages::TRANSPARENT;
+  // Recycle buffers through the calling thread's BufferPool, so repeated
+  // runs on same-sized images reuse warm memory (buffer-pool).
+  bool buffer_pool = true;
+  // The most free memory, in MiB, the pool keeps between runs; buffers
+  // released beyond that are freed (buffer-pool-size). What it keeps stays
+  // allocated until the thread exits or ia_release_buffers is called.
+  size_t buffer_pool_megabytes = BufferPool::DEFAULT_MAX_RETAINED >> 20;
+  // How many threads parallel loops use and how they share out the work
+  // (threads, schedule).
+  ParallelOptions parallel;
+  // Directory of an on-disk cache of smoothed images and final masks, keyed
+  // by the input pixels and the parameters each depends on; empty disables
+  // it (cache-dir). A rerun skips every stage before the first one whose
+  // parameters changed.
+  std::string cache_dir;
+  // Size the cache directory is kept under, least recently used entries
+  // going first (cache-size, in MiB).
+  size_t cache_megabytes = 1024;
+  // Print progress lines to stdout (verbose).
+  bool verbose = true;
+};
+
+// Sets a single option by name, e.g. ("perf", "1"). This is the common parser
+// behind the CLI's --name=value flags and ia_pipeline_set_option. Throws
+// std::invalid_argument for unknown names or malformed values.
+void set_option(PipelineOptions &options, const std::string &name,
+                const std::string &value);
+
+// Applies the options in a config file: one "name = value" per line, with
+// the names set_option takes; blank lines and text after '#' are ignored.
+// Throws std::runtime_error if the file cannot be read and
+// std::invalid_argument, naming the line, for a bad entry; either way
+// `options` is left unchanged.
+void load_options(PipelineOptions &options, const std::string &path);
+
+// Wall time and (optionally) hardware counters for one pipeline stage.
+struct StageMetrics {
+  std::string name;
+  double seconds = 0;
+  PerfSample counters;
+  // Busiest thread's time over the mean thread's time, summed over the
+  // stage's parallel loops (see ParallelContext). Zero for serial stages.
+  double imbalance = 0;
+};
+
+struct PipelineMetrics {
+  std::vector<StageMetrics> stages;
+  size_t pixel_count = 0;
+  // Threads the parallel stages were allowed to use.
+  size_t threads = 0;
+  // Buffers this run took from the buffer pool, and those it had to
+  // allocate.
+  size_t pool_hits = 0;
+  size_t pool_misses = 0;
+  // The process's RSS high-water mark when the run finished (see
+  // memory_usage.h); the run's own peak if the caller reset it beforehand,
+  // as process_image does.
+  size_t peak_rss_bytes = 0;
+  // Stage cache lookups that found an entry, and those that did not (see
+  // PipelineOptions::cache_dir).
+  size_t cache_hits = 0;
+  size_t cache_misses = 0;
+  int threshold = 0;
+  // Dialate passes run before the mask reached a fixed point (at most
+  // denoise_count).
+  int dialate_iterations = 0;
+
+  // Flattens the metrics into named values such as "threshold", "threads",
+  // "dialate.iterations", "total.seconds", "sobel.seconds",
+  // "dialate.imbalance", "pool.hit-rate", "cache.hits", "rss.peak-bytes" or
+  // "dialate.llc-misses". Counters that were unavailable are left out.
+  std::map<std::string, double> values() const;
+};
+
+// Runs the full pipeline on an interleaved 8-bit image. `input` is measured in
+// pixels horizontally but its stride is in bytes, so rows of `channels`-byte
+// pixels may be padded. `output` receives the binary mask and must have the
+// same width and height as `input`. Neither image is copied, so either may be
+// a sub-view of a larger frame (see ImageView::sub).
+void run_pipeline(ImageView<const unsigned char> input, int channels,
+                  ImageView<unsigned char> output,
+                  const PipelineOptions &options, PipelineMetrics &metrics);
+
+// Runs the pipeline for a region of interest only. `output` must be the size
+// of `roi`. Every stage is restricted to the pixels the later stages read, so
+// the cost scales with the ROI area plus a fixed halo (the summed stencil
+// radii) rather than the image area. The threshold histogram is taken over
+// the ROI, so the result can differ from the same crop of a full-image run.
+// `input` is only read by the first stage; `input_done`, if given, is called
+// right after it, so that the caller can free the input early.
+void run_pipeline(ImageView<const unsigned char> input, int channels,
+                  const Rect &roi, ImageView<unsigned char> output,
+                  const PipelineOptions &options, PipelineMetrics &metrics,
+                  const std::function<void()> &input_done = nullptr);
+
+// Averages the first three channels of each pixel into `output` (same size
+// as `input`). Images with fewer than three channels reduce to zero.
+void reduce_channels(ImageView<const unsigned char> input, int channels,
+                     ImageView<float> output);
+
+// Picks the most frequent 8-bit value in [1, 50] among the pixels of
+// `region`. Throws std::runtime_error if there are none.
+unsigned char select_threshold(ImageView<const float> pixels,
+                               const Rect &region);
+
+// Marks the pixels of `region` whose 8-bit value is less than `certainty`
+// from `threshold` as 255 and the rest as 0. If `occupancy` is set, it
+// receives the tile summary of the mask over `region`, counted in the same
+// pass.
+void apply_threshold(ImageView<const float> pixels, unsigned char threshold,
+                     int certainty, const Rect &region,
+                     ImageView<unsigned char> mask,
+                     OccupancyMap *occupancy = nullptr);
+
+// Parses "x,y,width,height" as used by --roi. Throws std::invalid_argument.
+Rect parse_rect(const std::string &text);
+
+// Prints per-stage timings with IPC and per-pixel miss rates. Memory-bound
+// stages show up as a low IPC together with high LLC/dTLB misses per pixel.
+void print_stage_report(const PipelineMetrics &metrics);
+
+// Writes an 8-bit mask as a single-channel PNG. The file is written under a
+// temporary name and renamed into place, so `path` either holds the whole
+// mask or is left as it was. Throws std::runtime_error on failure.
+void write_mask(const std::string &path, ImageView<const unsigned char> mask);
+
+// The file the mask of the `index`th ROI is written to: `output_path` with
+// "_roi<index>" before its extension, e.g. output_1.png -> output_1_roi0.png.
+std::string region_output_path(const std::string &output_path, size_t index);
+
+// Loads an image file, runs the pipeline on it and writes the mask as a PNG.
+// With `regions`, each ROI is processed and written separately, named by
+// region_output_path and written with write_mask.
+void process_image(const char *file_path, const char *output_path,
+                   const PipelineOptions &options,
+                   const std::vector<Rect> &regions = {});
+
+// Runs every non-iterated smoothing mode on an image's edge map and prints
+// its timing and deviation from the iterated reference, in the border band
+// and the interior separately, along with the threshold it leads to and how
+// much of the thresholded mask disagrees (--validate-smoothing).
+void validate_smoothing(const char *file_path,
+                        const StageParameters &parameters = {});
@@ -0,0 +1,609 @@
+#include "smoothing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "fft.h"
+#include "numa.h"
+#include "parallel.h"
+
+namespace {
+
+// Columns processed together in the vertical passes. Wide enough to vectorise,
+// narrow enough that a strip of a tall image stays in cache across passes.
+constexpr size_t STRIP_WIDTH = 64;
+
+// One renormalised box pass of radius `radius` along lines of `n` samples,
+// for `lanes` adjacent lines at once: sample i of lane j is data[i * step + j].
+// Samples outside [0, n) are skipped and the divisor shrinks accordingly,
+// exactly like blur_operator does at the image border.
+template <typename Radius>
+void box_pass(const float *input, float *output, size_t n, size_t lanes,
+              size_t step, Radius radius, std::vector<double> &sums) {
+  const size_t r = static_cast<int>(radius);
+  sums.assign(lanes, 0.0);
+  for (size_t i = 0; i < std::min<size_t>(r, n - 1) + 1; ++i) {
+    for (size_t j = 0; j < lanes; ++j) {
+      sums[j] += input[i * step + j];
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    size_t start = i > r ? i - r : 0;
+    size_t end = std::min<size_t>(i + r, n - 1);
+    double divisor = static_cast<double>(end - start + 1);
+
+    for (size_t j = 0; j < lanes; ++j) {
+      output[i * step + j] = static_cast<float>(sums[j] / divisor);
+    }
+    if (i + r + 1 < n) {
+      const float *entering = input + (i + r + 1) * step;
+      for (size_t j = 0; j < lanes; ++j) {
+        sums[j] += entering[j];
+      }
+    }
+    if (i >= r) {
+      const float *leaving = input + (i - r) * step;
+      for (size_t j = 0; j < lanes; ++j) {
+        sums[j] -= leaving[j];
+      }
+    }
+  }
+}
+
+// Feedback coefficients of a third-order recursive Gaussian:
+// w[n] = b * x[n] + a1 * w[n-1] + a2 * w[n-2] + a3 * w[n-3], run forwards and
+// then backwards (Young & van Vliet, 1995).
+struct IirCoefficients {
+  float b, a1, a2, a3;
+};
+
+// Uses the published fit from sigma to the filter parameter q. The recursive
+// response is not exactly Gaussian; this fit matches the shape of a Gaussian
+// (and hence the box cascade) more closely than choosing q to reproduce the
+// variance exactly would.
+IirCoefficients young_van_vliet(double sigma) {
+  double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                          : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+  double q2 = q * q, q3 = q2 * q;
+  double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+  double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+  double b2 = -(1.4281 * q2 + 1.26661 * q3);
+  double b3 = 0.422205 * q3;
+
+  IirCoefficients c;
+  c.a1 = static_cast<float>(b1 / b0);
+  c.a2 = static_cast<float>(b2 / b0);
+  c.a3 = static_cast<float>(b3 / b0);
+  c.b = 1.0f - (c.a1 + c.a2 + c.a3);
+  return c;
+}
+
+// Filters `lanes` adjacent lines of `n` samples in place, forwards and then
+// backwards; sample i of lane j is data[i * step + j]. Each pass starts from
+// the steady state of its first sample, i.e. the border is replicated. With
+// lanes > 1 the inner loops run across lanes and vectorise.
+void iir_pass(float *data, size_t n, size_t lanes, size_t step,
+              const IirCoefficients &c, std::vector<float> &state) {
+  state.resize(3 * lanes);
+  float *w1 = state.data(), *w2 = w1 + lanes, *w3 = w2 + lanes;
+
+  for (size_t j = 0; j < lanes; ++j) {
+    w1[j] = w2[j] = w3[j] = data[j];
+  }
+  for (size_t i = 0; i < n; ++i) {
+    float *line = data + i * step;
+    for (size_t j = 0; j < lanes; ++j) {
+      float v = c.b * line[j] + c.a1 * w1[j] + c.a2 * w2[j] + c.a3 * w3[j];
+      line[j] = v;
+      w3[j] = w2[j];
+      w2[j] = w1[j];
+      w1[j] = v;
+    }
+  }
+
+  const float *last = data + (n - 1) * step;
+  for (size_t j = 0; j < lanes; ++j) {
+    w1[j] = w2[j] = w3[j] = last[j];
+  }
+  for (size_t i = n; i-- > 0;) {
+    float *line = data + i * step;
+    for (size_t j = 0; j < lanes; ++j) {
+      float v = c.b * line[j] + c.a1 * w1[j] + c.a2 * w2[j] + c.a3 * w3[j];
+      line[j] = v;
+      w3[j] = w2[j];
+      w2[j] = w1[j];
+      w1[j] = v;
+    }
+  }
+}
+
+// Normalisation of the composite `kernel` at each position of a line of
+// `length` samples: the sum of the taps that fall inside it.
+std::vector<float> composite_norms(size_t first, size_t count, size_t length,
+                                   const std::vector<double> &kernel) {
+  long long radius = static_cast<long long>(kernel.size() / 2);
+  std::vector<float> norms(count);
+  for (size_t i = 0; i < count; ++i) {
+    double norm = 0;
+    for (long long d = -radius; d <= radius; ++d) {
+      long long p = static_cast<long long>(first + i) + d;
+      if (p >= 0 && p < static_cast<long long>(length)) {
+        norm += kernel[d + radius];
+      }
+    }
+    norms[i] = static_cast<float>(norm);
+  }
+  return norms;
+}
+
+void check_views(ImageView<const float> input, ImageView<float> output,
+                 const Rect &region) {
+  if (input.width != output.width || input.height != output.height) {
+    throw std::invalid_argument("smoothing input and output sizes differ");
+  }
+  if (region.x + region.width > input.width ||
+      region.y + region.height > input.height) {
+    throw std::out_of_range("smoothing region exceeds image bounds");
+  }
+}
+
+ConvolutionBackend resolve_backend(ConvolutionBackend backend, size_t taps,
+                                   size_t length, bool vectorised) {
+  if (backend != ConvolutionBackend::AUTO) {
+    return backend;
+  }
+  return fft_convolution_pays(taps, length, vectorised)
+             ? ConvolutionBackend::FFT
+             : ConvolutionBackend::DIRECT;
+}
+
+// The horizontal composite pass over `rows` (output column i is image column
+// rows.x + i), one dot product per pixel.
+void composite_rows_direct(ImageView<const float> input,
+                           ImageBuffer<float> &horizontal, const Rect &rows,
+                           const std::vector<float> &kernel,
+                           const std::vector<float> &x_norms) {
+  long long radius = static_cast<long long>(kernel.size() / 2);
+  parallel_for(rows.height, [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r) {
+      const float *row = input.row(rows.y + r);
+      float *out = horizontal.row(r);
+      for (size_t i = 0; i < rows.width; ++i) {
+        long long x = static_cast<long long>(rows.x + i);
+        long long start = std::max<long long>(x - radius, 0);
+        long long end_x = std::min<long long>(x + radius, input.width - 1);
+        const float *taps = kernel.data() + (start - x + radius);
+        float g = 0.0f;
+        for (long long p = start; p <= end_x; ++p) {
+          g += row[p] * taps[p - start];
+        }
+        out[i] = g / x_norms[i];
+      }
+    }
+  });
+}
+
+// The same by FFT, two rows per transform. `span` is the columns of input
+// the rows depend on.
+void composite_rows_fft(ImageView<const float> input,
+                        ImageBuffer<float> &horizontal, const Rect &rows,
+                        const Rect &span, const std::vector<float> &kernel,
+                        const std::vector<float> &x_norms) {
+  FftConvolver convolver(kernel, FftConvolver::default_fft_size(kernel.size()));
+  size_t offset_x = rows.x - span.x;
+
+  parallel_for((rows.height + 1) / 2, [&](size_t begin, size_t end) {
+    std::vector<float> a(span.width), b(span.width);
+    std::vector<std::complex<float>> work;
+    for (size_t pair = begin; pair < end; ++pair) {
+      size_t r = 2 * pair;
+      bool both = r + 1 < rows.height;
+      convolver.convolve(input.row(rows.y + r) + span.x,
+                         both ? input.row(rows.y + r + 1) + span.x : nullptr,
+                         span.width, a.data(), b.data(), work);
+      for (size_t line = 0; line < (both ? 2u : 1u); ++line) {
+        const float *filtered = (line == 0 ? a.data() : b.data()) + offset_x;
+        float *out = horizontal.row(r + line);
+        for (size_t i = 0; i < rows.width; ++i) {
+          out[i] = filtered[i] / x_norms[i];
+        }
+      }
+    }
+  });
+}
+
+// The vertical composite pass from `horizontal` (whose row 0 is image row
+// rows.y) into `region` of `output`, accumulating whole rows so the inner
+// loop runs across columns.
+void composite_columns_direct(const ImageBuffer<float> &horizontal,
+                              ImageView<float> output, const Rect &region,
+                              const Rect &rows,
+                              const std::vector<float> &kernel,
+                              const std::vector<float> &y_norms) {
+  long long radius = static_cast<long long>(kernel.size() / 2);
+  long long first = static_cast<long long>(rows.y);
+  long long last = static_cast<long long>(rows.y + rows.height) - 1;
+  parallel_for(region.height, [&](size_t begin, size_t end) {
+    std::vector<float> accumulator(region.width);
+    for (size_t r = begin; r < end; ++r) {
+      long long y = static_cast<long long>(region.y + r);
+      long long start = std::max(y - radius, first);
+      long long end_y = std::min(y + radius, last);
+
+      std::fill(accumulator.begin(), accumulator.end(), 0.0f);
+      for (long long p = start; p <= end_y; ++p) {
+        float weight = kernel[p - y + radius];
+        const float *row = horizontal.row(p - rows.y);
+        for (size_t i = 0; i < region.width; ++i) {
+          accumulator[i] += weight * row[i];
+        }
+      }
+
+      float *out = output.row(y) + region.x;
+      for (size_t i = 0; i < region.width; ++i) {
+        out[i] = accumulator[i] / y_norms[r];
+      }
+    }
+  });
+}
+
+// The same by FFT: STRIP_WIDTH columns are transposed into contiguous lines
+// and convolved two at a time.
+void composite_columns_fft(const ImageBuffer<float> &horizontal,
+                           ImageView<float> output, const Rect &region,
+                           const Rect &rows, const std::vector<float> &kernel,
+                           const std::vector<float> &y_norms) {
+  FftConvolver convolver(kernel, FftConvolver::default_fft_size(kernel.size()));
+  size_t offset_y = region.y - rows.y, n = rows.height;
+
+  size_t strip_count = (region.width + STRIP_WIDTH - 1) / STRIP_WIDTH;
+  parallel_for(strip_count, [&](size_t begin, size_t end) {
+    std::vector<float> lines(STRIP_WIDTH * n), filtered(STRIP_WIDTH * n);
+    std::vector<std::complex<float>> work;
+    for (size_t strip = begin; strip < end; ++strip) {
+      size_t x0 = strip * STRIP_WIDTH;
+      size_t lanes = std::min(STRIP_WIDTH, region.width - x0);
+
+      for (size_t r = 0; r < n; ++r) {
+        const float *row = horizontal.row(r) + x0;
+        for (size_t j = 0; j < lanes; ++j) {
+          lines[j * n + r] = row[j];
+        }
+      }
+      for (size_t j = 0; j < lanes; j += 2) {
+        bool both = j + 1 < lanes;
+        convolver.convolve(&lines[j * n], both ? &lines[(j + 1) * n] : nullptr,
+                           n, &filtered[j * n],
+                           both ? &filtered[(j + 1) * n] : nullptr, work);
+      }
+      for (size_t r = 0; r < region.height; ++r) {
+        float *out = output.row(region.y + r) + region.x + x0;
+        for (size_t j = 0; j < lanes; ++j) {
+          out[j] = filtered[j * n + r + offset_y] / y_norms[r];
+        }
+      }
+    }
+  });
+}
+
+// The running-sum smoothing: `count` box passes of radius `radius` along
+// rows and then along columns.
+template <typename Radius>
+void running_sum_cascade(ImageView<const float> input, ImageView<float> output,
+                         const Rect &region, int count, Radius radius) {
+  // Each pass is only exact `radius` further in from an edge of the span that
+  // is not an image edge, so the spans carry a count * radius halo.
+  Rect span = expand_rect(region, count * static_cast<int>(radius),
+                          input.width, input.height);
+  size_t offset_x = region.x - span.x, offset_y = region.y - span.y;
+
+  // Horizontal cascade: one row at a time, ping-ponging in two line buffers.
+  // The result is read back by column strips, which cut across the row
+  // bands, so its pages are interleaved rather than left with the writers.
+  ImageBuffer<float> horizontal(region.width, span.height);
+  interleave_pages(horizontal);
+  parallel_for(span.height, [&](size_t begin, size_t end) {
+    std::vector<float> a(span.width), b(span.width);
+    std::vector<double> sums;
+    for (size_t r = begin; r < end; ++r) {
+      const float *row = input.row(span.y + r) + span.x;
+      std::copy(row, row + span.width, a.begin());
+      for (int pass = 0; pass < count; ++pass) {
+        box_pass(a.data(), b.data(), span.width, 1, 1, radius, sums);
+        std::swap(a, b);
+      }
+      std::copy_n(a.begin() + offset_x, region.width, horizontal.row(r));
+    }
+  });
+
+  // Vertical cascade: strips of STRIP_WIDTH columns, all lanes in a strip
+  // updated together.
+  size_t strip_count = (region.width + STRIP_WIDTH - 1) / STRIP_WIDTH;
+  parallel_for(strip_count, [&](size_t begin, size_t end) {
+    std::vector<float> a(span.height * STRIP_WIDTH),
+        b(span.height * STRIP_WIDTH);
+    std::vector<double> sums;
+    for (size_t strip = begin; strip < end; ++strip) {
+      size_t x0 = strip * STRIP_WIDTH;
+      size_t lanes = std::min(STRIP_WIDTH, region.width - x0);
+
+      for (size_t r = 0; r < span.height; ++r) {
+        std::copy_n(horizontal.row(r) + x0, lanes, &a[r * STRIP_WIDTH]);
+      }
+      for (int pass = 0; pass < count; ++pass) {
+        box_pass(a.data(), b.data(), span.height, lanes, STRIP_WIDTH, radius,
+                 sums);
+        std::swap(a, b);
+      }
+      for (size_t r = 0; r < region.height; ++r) {
+        std::copy_n(&a[(r + offset_y) * STRIP_WIDTH], lanes,
+                    output.row(region.y + r) + region.x + x0);
+      }
+    }
+  });
+}
+
+} // namespace
+
+SmoothingMode parse_smoothing_mode(const std::string &name) {
+  if (name == "iterated") {
+    return SmoothingMode::ITERATED;
+  }
+  if (name == "composite") {
+    return SmoothingMode::COMPOSITE;
+  }
+  if (name == "running-sum") {
+    return SmoothingMode::RUNNING_SUM;
+  }
+  if (name == "iir") {
+    return SmoothingMode::IIR;
+  }
+  throw std::invalid_argument("unknown smoothing mode " + name);
+}
+
+const char *smoothing_mode_name(SmoothingMode mode) {
+  switch (mode) {
+  case SmoothingMode::ITERATED:
+    return "iterated";
+  case SmoothingMode::COMPOSITE:
+    return "composite";
+  case SmoothingMode::RUNNING_SUM:
+    return "running-sum";
+  case SmoothingMode::IIR:
+    return "iir";
+  }
+  return "unknown";
+}
+
+ConvolutionBackend parse_convolution_backend(const std::string &name) {
+  if (name == "auto") {
+    return ConvolutionBackend::AUTO;
+  }
+  if (name == "direct") {
+    return ConvolutionBackend::DIRECT;
+  }
+  if (name == "fft") {
+    return ConvolutionBackend::FFT;
+  }
+  throw std::invalid_argument("unknown convolution backend " + name);
+}
+
+const char *convolution_backend_name(ConvolutionBackend backend) {
+  switch (backend) {
+  case ConvolutionBackend::AUTO:
+    return "auto";
+  case ConvolutionBackend::DIRECT:
+    return "direct";
+  case ConvolutionBackend::FFT:
+    return "fft";
+  }
+  return "unknown";
+}
+
+bool fft_convolution_pays(size_t taps, size_t length, bool vectorised) {
+  // Costs per output sample, in units of one scalar multiply-add, fitted to
+  // timings of smooth_composite on the benchmark images: with the 121-tap
+  // composite kernel the FFT is about ten times faster than the per-sample
+  // dot products of the horizontal pass, but no faster than the vertical
+  // pass, whose direct loop vectorises across columns and whose FFT also
+  // pays for transposing strips.
+  //   direct: one multiply-add per tap, DIRECT_VECTOR_COST each when the
+  //     loop runs across lines.
+  //   fft: BUTTERFLY_COST per butterfly of the forward and inverse
+  //     transforms, shared by the block() samples of two lines, plus the
+  //     fixed per-sample work of packing, accumulating and normalising.
+  constexpr double DIRECT_VECTOR_COST = 0.1;
+  constexpr double BUTTERFLY_COST = 1.5;
+  constexpr double FFT_SAMPLE_COST = 4.0;
+
+  double direct = taps * (vectorised ? DIRECT_VECTOR_COST : 1.0);
+
+  size_t n = FftConvolver::default_fft_size(taps);
+  size_t block = n - taps + 1, blocks = (length + block - 1) / block;
+  double log_n = std::log2(static_cast<double>(n));
+  double fft = blocks * (n * log_n * BUTTERFLY_COST) / (2.0 * length) +
+               FFT_SAMPLE_COST;
+  return fft < direct;
+}
+
+std::vector<double> composite_blur_kernel(const StageParameters &parameters) {
+  if (parameters.blur_count == StageParameters{}.blur_count &&
+      parameters.blur_radius == StageParameters{}.blur_radius) {
+    return std::vector<double>(DEFAULT_COMPOSITE_BLUR_KERNEL.begin(),
+                               DEFAULT_COMPOSITE_BLUR_KERNEL.end());
+  }
+
+  int radius = composite_radius(parameters), taps = 2 * radius + 1;
+  std::vector<double> kernel(taps), next(taps);
+  kernel[radius] = 1.0;
+  convolve_box_cascade(kernel, next, taps, parameters.blur_count,
+                       parameters.blur_radius);
+  return kernel;
+}
+
+void smooth_composite(ImageView<const float> input, ImageView<float> output,
+                      const Rect &region, const StageParameters &parameters,
+                      ConvolutionBackend backend) {
+  check_views(input, output, region);
+  size_t radius = composite_radius(parameters);
+
+  // Rows above and below the region feed the vertical pass.
+  Rect rows = expand_rect(region, radius, input.width, input.height);
+  rows.x = region.x;
+  rows.width = region.width;
+
+  std::vector<double> weights = composite_blur_kernel(parameters);
+  std::vector<float> kernel(weights.begin(), weights.end());
+  std::vector<float> x_norms =
+      composite_norms(region.x, region.width, input.width, weights);
+  std::vector<float> y_norms =
+      composite_norms(region.y, region.height, input.height, weights);
+
+  ImageBuffer<float> horizontal(rows.width, rows.height);
+
+  Rect span = expand_rect(region, radius, input.width, input.height);
+  if (resolve_backend(backend, kernel.size(), span.width, false) ==
+      ConvolutionBackend::FFT) {
+    composite_rows_fft(input, horizontal, rows, span, kernel, x_norms);
+  } else {
+    composite_rows_direct(input, horizontal, rows, kernel, x_norms);
+  }
+
+  if (resolve_backend(backend, kernel.size(), rows.height, true) ==
+      ConvolutionBackend::FFT) {
+    composite_columns_fft(horizontal, output, region, rows, kernel, y_norms);
+  } else {
+    composite_columns_direct(horizontal, output, region, rows, kernel,
+                             y_norms);
+  }
+}
+
+void smooth_running_sum(ImageView<const float> input, ImageView<float> output,
+                        const Rect &region, const StageParameters &parameters) {
+  check_views(input, output, region);
+  with_radius(parameters.blur_radius, [&](auto radius) {
+    running_sum_cascade(input, output, region, parameters.blur_count, radius);
+  });
+}
+
+void smooth_iir(ImageView<const float> input, ImageView<float> output,
+                const Rect &region, const StageParameters &parameters) {
+  check_views(input, output, region);
+
+  // The response is infinite, but beyond composite_radius (about 6.7 sigma
+  // with the default parameters; less with few passes) it is negligible, so
+  // the same halo as the exact modes is enough and ROI runs need no extra
+  // input.
+  Rect span = expand_rect(region, composite_radius(parameters), input.width,
+                          input.height);
+  size_t offset_x = region.x - span.x, offset_y = region.y - span.y;
+  IirCoefficients coefficients =
+      young_van_vliet(box_cascade_sigma(parameters));
+
+  // Row-parallel horizontal pass. Interleaved, as for the running sum.
+  ImageBuffer<float> filtered(region.width, span.height);
+  interleave_pages(filtered);
+  parallel_for(span.height, [&](size_t begin, size_t end) {
+    std::vector<float> line(span.width), state;
+    for (size_t r = begin; r < end; ++r) {
+      const float *row = input.row(span.y + r) + span.x;
+      std::copy(row, row + span.width, line.begin());
+      iir_pass(line.data(), span.width, 1, 1, coefficients, state);
+      std::copy_n(line.begin() + offset_x, region.width, filtered.row(r));
+    }
+  });
+
+  // Column-parallel vertical pass, in place, STRIP_WIDTH columns at a time.
+  size_t strip_count = (region.width + STRIP_WIDTH - 1) / STRIP_WIDTH;
+  parallel_for(strip_count, [&](size_t begin, size_t end) {
+    std::vector<float> state;
+    for (size_t strip = begin; strip < end; ++strip) {
+      size_t x0 = strip * STRIP_WIDTH;
+      size_t lanes = std::min(STRIP_WIDTH, region.width - x0);
+      iir_pass(filtered.data() + x0, span.height, lanes, filtered.stride(),
+               coefficients, state);
+      for (size_t r = 0; r < region.height; ++r) {
+        std::copy_n(filtered.row(r + offset_y) + x0, lanes,
+                    output.row(region.y + r) + region.x + x0);
+      }
+    }
+  });
+}
+
+void smooth(ImageBuffer<float> &pixels, ImageBuffer<float> &scratch,
+            const Rect &region, SmoothingMode mode,
+            const StageParameters &parameters,
+            const BlockingOptions &blocking, ConvolutionBackend convolution,
+            const std::function<void(int)> &progress) {
+  switch (mode) {
+  case SmoothingMode::ITERATED:
+    apply_kernel_n(pixels, scratch, blur_kernel(parameters.blur_radius),
+                   parameters.blur_radius, parameters.blur_count, region,
+                   blocking, progress);
+    break;
+  case SmoothingMode::COMPOSITE:
+    smooth_composite(pixels.view(), scratch.view(), region, parameters,
+                     convolution);
+    std::swap(pixels, scratch);
+    break;
+  case SmoothingMode::RUNNING_SUM:
+    smooth_running_sum(pixels.view(), scratch.view(), region, parameters);
+    std::swap(pixels, scratch);
+    break;
+  case SmoothingMode::IIR:
+    smooth_iir(pixels.view(), scratch.view(), region, parameters);
+    std::swap(pixels, scratch);
+    break;
+  }
+}
+
+SmoothingDeviation compare_smoothing(ImageView<const float> reference,
+                                     ImageView<const float> candidate,
+                                     size_t band) {
+  if (reference.width != candidate.width ||
+      reference.height != candidate.height) {
+    throw std::invalid_argument("compared images differ in size");
+  }
+
+  SmoothingDeviation deviation;
+  size_t border_count = 0, interior_count = 0, mismatched = 0;
+
+  for (size_t y = 0; y < reference.height; ++y) {
+    for (size_t x = 0; x < reference.width; ++x) {
+      float a = reference.at(x, y), b = candidate.at(x, y);
+      double error = std::abs(static_cast<double>(a) - b);
+      bool border = x < band || y < band || x + band >= reference.width ||
+                    y + band >= reference.height;
+
+      if (border) {
+        deviation.border_max = std::max(deviation.border_max, error);
+        deviation.border_mean += error;
+        ++border_count;
+      } else {
+        deviation.interior_max = std::max(deviation.interior_max, error);
+        deviation.interior_mean += error;
+        ++interior_count;
+      }
+
+      if (static_cast<unsigned char>(a) != static_cast<unsigned char>(b)) {
+        ++mismatched;
+      }
+    }
+  }
+
+  if (border_count > 0) {
+    deviation.border_mean /= border_count;
+  }
+  if (interior_count > 0) {
+    deviation.interior_mean /= interior_count;
+  }
+  deviation.byte_mismatch =
+      static_cast<double>(mismatched) / (reference.width * reference.height);
+
+  return deviation;
+}
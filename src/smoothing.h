@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "image_buffer.h"
+#include "operators.h"
+
+// How the blur passes after edge detection (StageParameters::blur_count of
+// them, of radius blur_radius) are carried out.
+enum class SmoothingMode {
+  // blur_count full passes of blur_operator (the reference).
+  ITERATED,
+  // One separable pass with the precomputed composite kernel. Matches
+  // ITERATED up to float rounding away from the image border; within
+  // composite_radius of it the renormalisation happens once instead of per
+  // pass, so values drift.
+  COMPOSITE,
+  // blur_count box passes per row and then per column using running sums.
+  // The 2D box blur is separable, renormalisation included, so this matches
+  // ITERATED up to float rounding at O(1) cost per pixel per pass.
+  RUNNING_SUM,
+  // A recursive (Young-van Vliet) Gaussian with the variance of the box
+  // cascade, box_cascade_sigma. Constant cost per pixel whatever the sigma,
+  // but only an approximation: the box cascade is not exactly Gaussian and
+  // borders are replicated rather than renormalised.
+  IIR,
+};
+
+// Parses "iterated", "composite", "running-sum" or "iir".
+SmoothingMode parse_smoothing_mode(const std::string &name);
+const char *smoothing_mode_name(SmoothingMode mode);
+
+// How COMPOSITE applies its kernel along each axis.
+enum class ConvolutionBackend {
+  // Chosen per axis by fft_convolution_pays.
+  AUTO,
+  // A multiply-add per tap per pixel.
+  DIRECT,
+  // Overlap-add FFT convolution (fft.h): the cost per pixel grows with the
+  // log of the kernel size rather than linearly. Matches DIRECT up to float
+  // rounding.
+  FFT,
+};
+
+// Parses "auto", "direct" or "fft".
+ConvolutionBackend parse_convolution_backend(const std::string &name);
+const char *convolution_backend_name(ConvolutionBackend backend);
+
+// The cost model behind AUTO: whether convolving lines of `length` samples
+// with a `taps`-tap kernel is cheaper by FFT than directly. `vectorised` says
+// whether the direct loop runs across many lines at once (as the vertical
+// pass does) rather than as one dot product per sample.
+bool fft_convolution_pays(size_t taps, size_t length, bool vectorised);
+
+// Support radius of the blur cascade: blur_count boxes of radius
+// blur_radius.
+constexpr int composite_radius(const StageParameters &parameters) {
+  return parameters.blur_count * parameters.blur_radius;
+}
+
+// Convolves `kernel`, a unit impulse at the centre of its `taps` entries,
+// with `count` boxes of radius `box` in turn, using `next` (also `taps` long)
+// as scratch. Works on std::array at compile time and std::vector at run
+// time, with the same arithmetic either way.
+template <typename Kernel>
+constexpr void convolve_box_cascade(Kernel &kernel, Kernel &next, int taps,
+                                    int count, int box) {
+  for (int pass = 0; pass < count; ++pass) {
+    for (int i = 0; i < taps; ++i) {
+      next[i] = 0.0;
+      for (int d = -box; d <= box; ++d) {
+        if (i + d >= 0 && i + d < taps) {
+          next[i] += kernel[i + d] / (2 * box + 1);
+        }
+      }
+    }
+    for (int i = 0; i < taps; ++i) {
+      kernel[i] = next[i];
+    }
+  }
+}
+
+// The composite kernel for the default StageParameters, built at compile
+// time.
+constexpr int DEFAULT_COMPOSITE_RADIUS = composite_radius(StageParameters{});
+
+constexpr std::array<double, 2 * DEFAULT_COMPOSITE_RADIUS + 1>
+default_composite_blur_kernel() {
+  std::array<double, 2 * DEFAULT_COMPOSITE_RADIUS + 1> kernel{}, next{};
+  kernel[DEFAULT_COMPOSITE_RADIUS] = 1.0;
+  convolve_box_cascade(kernel, next, 2 * DEFAULT_COMPOSITE_RADIUS + 1,
+                       StageParameters{}.blur_count,
+                       StageParameters{}.blur_radius);
+  return kernel;
+}
+
+constexpr std::array<double, 2 * DEFAULT_COMPOSITE_RADIUS + 1>
+    DEFAULT_COMPOSITE_BLUR_KERNEL = default_composite_blur_kernel();
+
+// The 1D kernel equal to the cascaded boxes, i.e. the box convolved with
+// itself blur_count times. The 2D composite is its outer product with itself.
+// DEFAULT_COMPOSITE_BLUR_KERNEL for the default blur parameters, otherwise
+// computed on each call.
+std::vector<double> composite_blur_kernel(const StageParameters &parameters);
+
+// Standard deviation of the blur cascade: each box of 2 * blur_radius + 1
+// taps has variance ((2 * blur_radius + 1)^2 - 1) / 12 and variances add.
+inline double box_cascade_sigma(const StageParameters &parameters) {
+  int taps = 2 * parameters.blur_radius + 1;
+  return std::sqrt(parameters.blur_count * (taps * taps - 1.0) / 12.0);
+}
+
+// Computes the pixels of `output` inside `region` as the result of the blur
+// passes of `parameters` over `input`, without the intermediate passes. The
+// views must be the same size; `input` must be valid within composite_radius
+// of `region` (or up to the image edge).
+void smooth_composite(ImageView<const float> input, ImageView<float> output,
+                      const Rect &region, const StageParameters &parameters,
+                      ConvolutionBackend backend = ConvolutionBackend::AUTO);
+void smooth_running_sum(ImageView<const float> input, ImageView<float> output,
+                        const Rect &region, const StageParameters &parameters);
+void smooth_iir(ImageView<const float> input, ImageView<float> output,
+                const Rect &region, const StageParameters &parameters);
+
+// Applies the blur passes of `parameters` (or an equivalent) to the pixels of
+// `pixels` inside `region`, using `scratch` (same size) as a second buffer;
+// the two are swapped as needed so `pixels` holds the result. The iterated
+// mode is temporally blocked according to `blocking` and calls `progress` as
+// its passes complete; the composite mode convolves with `convolution`.
+void smooth(ImageBuffer<float> &pixels, ImageBuffer<float> &scratch,
+            const Rect &region, SmoothingMode mode,
+            const StageParameters &parameters,
+            const BlockingOptions &blocking = {},
+            ConvolutionBackend convolution = ConvolutionBackend::AUTO,
+            const std::function<void(int)> &progress = nullptr);
+
+// Deviation of a smoothing mode from ITERATED, split between the border band
+// (within `band` of an edge, normally composite_radius) and the interior.
+struct SmoothingDeviation {
+  double border_max = 0, border_mean = 0;
+  double interior_max = 0, interior_mean = 0;
+  // Fraction of pixels whose 8-bit value, the one the threshold stage sees,
+  // differs from the reference.
+  double byte_mismatch = 0;
+};
+
+SmoothingDeviation compare_smoothing(ImageView<const float> reference,
+                                     ImageView<const float> candidate,
+                                     size_t band);
@@ -0,0 +1,270 @@
+#include "stage_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Every entry file starts with this header.
+struct EntryHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t kind;
+  uint32_t width, height;
+  int32_t threshold;
+  int32_t dialate_iterations;
+  uint32_t payload_bytes;
+};
+
+constexpr char ENTRY_MAGIC[4] = {'I', 'A', 'C', 'E'};
+constexpr uint32_t ENTRY_VERSION = 1;
+constexpr const char *ENTRY_EXTENSION = ".iac";
+
+// Numbers the temporary files this process writes, so that pipelines storing
+// the same entry from several threads do not write to the same one.
+std::atomic<unsigned long> temporary_count{0};
+
+uint64_t rotate(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+// The splitmix64 finaliser: every input bit affects every output bit.
+uint64_t finalise(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+std::vector<unsigned char> encode(const CacheEntry &entry) {
+  if (entry.kind == CacheEntry::GRAY) {
+    return entry.pixels;
+  }
+  std::vector<unsigned char> bits((entry.pixels.size() + 7) / 8);
+  for (size_t i = 0; i < entry.pixels.size(); ++i) {
+    bits[i / 8] |= (entry.pixels[i] != 0) << (i % 8);
+  }
+  return bits;
+}
+
+bool decode(const std::vector<unsigned char> &payload, CacheEntry &entry) {
+  size_t count = entry.width * entry.height;
+  if (entry.kind == CacheEntry::GRAY) {
+    if (payload.size() != count) {
+      return false;
+    }
+    entry.pixels = payload;
+    return true;
+  }
+  if (payload.size() != (count + 7) / 8) {
+    return false;
+  }
+  entry.pixels.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    entry.pixels[i] = (payload[i / 8] >> (i % 8)) & 1 ? 255 : 0;
+  }
+  return true;
+}
+
+} // namespace
+
+std::string CacheKey::hex() const {
+  char text[33];
+  std::snprintf(text, sizeof(text), "%016llx%016llx",
+                static_cast<unsigned long long>(high),
+                static_cast<unsigned long long>(low));
+  return text;
+}
+
+ContentHasher::ContentHasher()
+    : a_(0x9e3779b97f4a7c15ull), b_(0xc2b2ae3d27d4eb4full) {}
+
+void ContentHasher::mix(uint64_t word) {
+  a_ = rotate(a_ ^ (word * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+  b_ = rotate(b_ + (word ^ 0x52dce729da3ed7b5ull), 27) * 0x9e3779b97f4a7c15ull +
+       a_;
+}
+
+void ContentHasher::add(const void *data, size_t bytes) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  length_ += bytes;
+
+  while (tail_size_ > 0 && tail_size_ < 8 && bytes > 0) {
+    tail_[tail_size_++] = *p++;
+    --bytes;
+  }
+  if (tail_size_ == 8) {
+    uint64_t word;
+    std::memcpy(&word, tail_, 8);
+    mix(word);
+    tail_size_ = 0;
+  }
+
+  for (; bytes >= 8; p += 8, bytes -= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    mix(word);
+  }
+  std::memcpy(tail_ + tail_size_, p, bytes);
+  tail_size_ += bytes;
+}
+
+CacheKey ContentHasher::key() const {
+  ContentHasher copy = *this;
+  uint64_t word = 0;
+  std::memcpy(&word, copy.tail_, copy.tail_size_);
+  copy.mix(word ^ (static_cast<uint64_t>(copy.tail_size_) << 56));
+  copy.mix(length_);
+
+  CacheKey key;
+  key.high = finalise(copy.a_ + copy.b_);
+  key.low = finalise(copy.b_ ^ rotate(copy.a_, 32));
+  return key;
+}
+
+StageCache::StageCache(std::string directory, size_t max_bytes)
+    : directory_(std::move(directory)), max_bytes_(max_bytes) {
+  std::error_code error;
+  fs::create_directories(directory_, error);
+}
+
+std::string StageCache::path(const CacheKey &key) const {
+  return (fs::path(directory_) / (key.hex() + ENTRY_EXTENSION)).string();
+}
+
+bool StageCache::load(const CacheKey &key, CacheEntry::Kind kind,
+                      CacheEntry &entry) {
+  std::string file_path = path(key);
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file) {
+    ++misses_;
+    return false;
+  }
+
+  EntryHeader header;
+  std::vector<unsigned char> payload;
+  bool valid = false;
+  if (file.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+      std::memcmp(header.magic, ENTRY_MAGIC, 4) == 0 &&
+      header.version == ENTRY_VERSION && header.kind == kind) {
+    payload.resize(header.payload_bytes);
+    valid = static_cast<bool>(
+        file.read(reinterpret_cast<char *>(payload.data()), payload.size()));
+  }
+  if (valid) {
+    entry.kind = kind;
+    entry.width = header.width;
+    entry.height = header.height;
+    entry.threshold = header.threshold;
+    entry.dialate_iterations = header.dialate_iterations;
+    valid = decode(payload, entry);
+  }
+  file.close();
+
+  std::error_code error;
+  if (!valid) {
+    fs::remove(file_path, error);
+    ++misses_;
+    return false;
+  }
+
+  // The modification time doubles as the last use for eviction.
+  fs::last_write_time(file_path, fs::file_time_type::clock::now(), error);
+  ++hits_;
+  return true;
+}
+
+void StageCache::store(const CacheKey &key, const CacheEntry &entry) {
+  std::vector<unsigned char> payload = encode(entry);
+
+  EntryHeader header;
+  std::memcpy(header.magic, ENTRY_MAGIC, 4);
+  header.version = ENTRY_VERSION;
+  header.kind = entry.kind;
+  header.width = static_cast<uint32_t>(entry.width);
+  header.height = static_cast<uint32_t>(entry.height);
+  header.threshold = entry.threshold;
+  header.dialate_iterations = entry.dialate_iterations;
+  header.payload_bytes = static_cast<uint32_t>(payload.size());
+
+  std::string final_path = path(key);
+  std::string temporary = final_path + ".tmp" +
+                          std::to_string(static_cast<long>(getpid())) + "." +
+                          std::to_string(temporary_count++);
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+    if (!file) {
+      std::error_code error;
+      fs::remove(temporary, error);
+      return;
+    }
+  }
+
+  std::error_code error;
+  fs::rename(temporary, final_path, error);
+  if (error) {
+    fs::remove(temporary, error);
+    return;
+  }
+
+  uintmax_t bytes = sizeof(header) + payload.size();
+  if (scanned_ && used_bytes_ + bytes <= max_bytes_) {
+    used_bytes_ += bytes;
+    return;
+  }
+  evict();
+}
+
+void StageCache::evict() {
+  struct Entry {
+    fs::path path;
+    fs::file_time_type used;
+    uintmax_t bytes;
+  };
+  std::vector<Entry> entries;
+  uintmax_t total = 0;
+
+  std::error_code error;
+  for (fs::directory_iterator it(directory_, error), end; !error && it != end;
+       it.increment(error)) {
+    if (it->path().extension() != ENTRY_EXTENSION) {
+      continue;
+    }
+    std::error_code stat_error;
+    Entry entry{it->path(), fs::last_write_time(it->path(), stat_error),
+                fs::file_size(it->path(), stat_error)};
+    if (!stat_error) {
+      total += entry.bytes;
+      entries.push_back(std::move(entry));
+    }
+  }
+  scanned_ = true;
+  used_bytes_ = total;
+  if (total <= max_bytes_) {
+    return;
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) { return a.used < b.used; });
+  for (const Entry &entry : entries) {
+    if (total <= max_bytes_) {
+      break;
+    }
+    if (fs::remove(entry.path, error)) {
+      total -= entry.bytes;
+      ++evictions_;
+    }
+  }
+  used_bytes_ = total;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// A 128-bit content hash, used as a cache key.
+struct CacheKey {
+  uint64_t high = 0, low = 0;
+
+  // 32 hex digits, used as the entry's file name.
+  std::string hex() const;
+};
+
+// Incrementally hashes bytes and values into a CacheKey. Not cryptographic:
+// two independently seeded 64-bit lanes, so accidental collisions between
+// cache entries are vanishingly unlikely, not impossible by design.
+class ContentHasher {
+public:
+  ContentHasher();
+
+  void add(const void *data, size_t bytes);
+
+  // Adds a plain value (integers, enums, floats) by its bytes.
+  template <typename T> void add_value(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "add_value hashes the object representation");
+    add(&value, sizeof(value));
+  }
+
+  CacheKey key() const;
+
+private:
+  void mix(uint64_t word);
+
+  uint64_t a_, b_;
+  size_t length_ = 0;
+  // Bytes not yet forming a whole 8-byte word.
+  unsigned char tail_[8];
+  size_t tail_size_ = 0;
+};
+
+// An 8-bit image as the cache stores it, plus the scalars a pipeline run
+// needs to skip the stages that produced it.
+struct CacheEntry {
+  enum Kind : uint32_t {
+    // Any 8-bit values, stored as they are.
+    GRAY = 1,
+    // Only 0 and 255, stored one bit per pixel.
+    MASK = 2,
+  };
+
+  Kind kind = GRAY;
+  size_t width = 0, height = 0;
+  // Row-major, width * height bytes.
+  std::vector<unsigned char> pixels;
+  int threshold = 0;
+  int dialate_iterations = 0;
+};
+
+// A content-addressed cache of CacheEntry files in one directory, bounded in
+// total size. Entries are written to a temporary file of their own and
+// renamed into place, so concurrent pipelines sharing the directory, in other
+// processes or on other threads, never see or write partial entries.
+// Loading an entry marks it as recently used; storing one evicts the least
+// recently used entries until the directory fits in `max_bytes`. The
+// directory is only scanned for that on the first store and whenever the
+// entries stored since push the last scan's total over the limit, so with
+// several processes sharing it the bound can be overshot by what the others
+// stored in between.
+//
+// I/O failures are never fatal: a missing, unreadable or corrupt entry is a
+// miss (and a corrupt one is deleted), and a failed store is dropped.
+class StageCache {
+public:
+  StageCache(std::string directory, size_t max_bytes);
+
+  // Fills `entry` and returns true if `key` is cached as `kind`.
+  bool load(const CacheKey &key, CacheEntry::Kind kind, CacheEntry &entry);
+  void store(const CacheKey &key, const CacheEntry &entry);
+
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+  size_t evictions() const { return evictions_; }
+
+private:
+  std::string path(const CacheKey &key) const;
+  void evict();
+
+  std::string directory_;
+  size_t max_bytes_;
+  // The directory's size at the last scan plus the entries stored since.
+  uintmax_t used_bytes_ = 0;
+  bool scanned_ = false;
+  size_t hits_ = 0, misses_ = 0, evictions_ = 0;
+};
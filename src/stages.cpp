@@ -0,0 +1,320 @@
+#include "stages.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <utility>
+
+#include "cpu_budget.h"
+#include "memory_usage.h"
+#include "numa.h"
+#include "operators.h"
+#include "smoothing.h"
+
+StageRegions stage_regions(const Rect &roi, size_t width, size_t height,
+                           const StageParameters &parameters) {
+  size_t blur_radius = parameters.blur_radius;
+  size_t dialate_halo =
+      static_cast<size_t>(parameters.denoise_count) * parameters.denoise_radius;
+  size_t smooth_halo = dialate_halo + composite_radius(parameters);
+
+  StageRegions regions;
+  regions.roi = roi;
+  regions.mask = expand_rect(roi, dialate_halo, width, height);
+  regions.sobel = expand_rect(roi, smooth_halo, width, height);
+  regions.blur = expand_rect(roi, smooth_halo + 1, width, height);
+  regions.outer =
+      expand_rect(roi, smooth_halo + 1 + blur_radius, width, height);
+  return regions;
+}
+
+StageRunner::StageRunner(const PipelineOptions &options,
+                         PipelineMetrics &metrics)
+    : options_(options), metrics_(&metrics), parallel_(options.parallel),
+      pool_(options.buffer_pool ? &BufferPool::thread_pool() : nullptr),
+      pool_scope_(pool_), huge_pages_scope_(options.huge_pages) {
+  if (options.perf_counters) {
+    counters_ = std::make_unique<PerfCounters>();
+    if (!counters_->available()) {
+      if (options.verbose) {
+        std::cout
+            << "-performance counters unavailable, reporting timings only"
+            << std::endl;
+      }
+      counters_.reset();
+    }
+  }
+  if (pool_) {
+    pool_->set_max_retained(options.buffer_pool_megabytes << 20);
+  }
+  if (!options.cache_dir.empty()) {
+    cache_ = std::make_unique<StageCache>(options.cache_dir,
+                                          options.cache_megabytes << 20);
+  }
+  record_into(metrics);
+}
+
+void StageRunner::record_into(PipelineMetrics &metrics) {
+  metrics_ = &metrics;
+  metrics.stages.clear();
+  metrics.threads =
+      options_.parallel.threads ? options_.parallel.threads : cpu_budget();
+  pool_hits_ = pool_ ? pool_->hits() : 0;
+  pool_misses_ = pool_ ? pool_->misses() : 0;
+  cache_hits_ = cache_ ? cache_->hits() : 0;
+  cache_misses_ = cache_ ? cache_->misses() : 0;
+}
+
+void StageRunner::measure(const char *name,
+                          const std::function<void()> &stage) {
+  StageMetrics metrics;
+  metrics.name = name;
+  // Every parallel loop of the stage, including buffer placement, uses the
+  // run's thread options.
+  ParallelContext parallel(options_.parallel);
+
+  if (counters_) {
+    counters_->start();
+  }
+  auto start = std::chrono::steady_clock::now();
+
+  stage();
+
+  auto end = std::chrono::steady_clock::now();
+  if (counters_) {
+    metrics.counters = counters_->stop();
+  }
+  metrics.seconds = std::chrono::duration<double>(end - start).count();
+  metrics.imbalance = parallel.imbalance();
+
+  metrics_->stages.push_back(metrics);
+}
+
+void StageRunner::finish() {
+  metrics_->pool_hits = pool_ ? pool_->hits() - pool_hits_ : 0;
+  metrics_->pool_misses = pool_ ? pool_->misses() - pool_misses_ : 0;
+  metrics_->cache_hits = cache_ ? cache_->hits() - cache_hits_ : 0;
+  metrics_->cache_misses = cache_ ? cache_->misses() - cache_misses_ : 0;
+  // Every buffer but the caller's output is still live here.
+  metrics_->peak_rss_bytes = peak_rss_bytes();
+}
+
+void reduce_stage(StageRunner &runner, ImageView<const unsigned char> input,
+                  int channels, const StageRegions &regions,
+                  ImageBuffer<float> &gray) {
+  runner.measure("reduce", [&]() {
+    reduce_channels(input.sub(regions.outer, channels), channels,
+                    gray.view());
+  });
+  if (runner.options().verbose) {
+    std::cout << "-reduced channels" << std::endl;
+  }
+}
+
+void edge_stage(StageRunner &runner, const StageRegions &regions,
+                const StageParameters &parameters, ImageBuffer<float> &pixels,
+                ImageBuffer<float> &scratch) {
+  auto apply = [&](KernelFunc kernel_func, const Rect &region) {
+    apply_kernel(pixels.view(), scratch.view(), kernel_func,
+                 regions.local(region));
+    std::swap(pixels, scratch);
+  };
+
+  if (runner.options().edges == EdgeFilter::SEPARABLE) {
+    // One pass straight from the grayscale image to the edge map.
+    runner.measure("edges", [&]() {
+      apply_separable_abs_sum(pixels.view(), scratch.view(),
+                              regions.local(regions.sobel),
+                              blurred_sobel_filters(parameters.blur_radius));
+      std::swap(pixels, scratch);
+    });
+  } else {
+    runner.measure("blur", [&]() {
+      apply(blur_kernel(parameters.blur_radius), regions.blur);
+    });
+
+    runner.measure("sobel", [&]() { apply(sobel_operator, regions.sobel); });
+  }
+
+  if (runner.options().verbose) {
+    std::cout << "-finished edge detection" << std::endl;
+  }
+}
+
+void smooth_stage(StageRunner &runner, const StageRegions &regions,
+                  const StageParameters &parameters,
+                  ImageBuffer<float> &pixels, ImageBuffer<float> &scratch) {
+  const PipelineOptions &options = runner.options();
+  runner.measure("smooth", [&]() {
+    smooth(pixels, scratch, regions.local(regions.mask), options.smoothing,
+           parameters, options.blocking, options.convolution, [&](int i) {
+             if (options.verbose) {
+               std::cout << "-blur %"
+                         << (static_cast<float>(i) / parameters.blur_count *
+                             100)
+                         << " complete" << std::endl;
+             }
+           });
+  });
+}
+
+int threshold_stage(StageRunner &runner, const StageRegions &regions,
+                    const StageParameters &parameters,
+                    const ImageBuffer<float> &pixels,
+                    ImageBuffer<unsigned char> &mask,
+                    OccupancyMap &occupancy) {
+  const PipelineOptions &options = runner.options();
+  if (options.verbose) {
+    std::cout << "-mapping pixel values" << std::endl;
+  }
+
+  // Only the frontier engine can use the tile summary.
+  bool summarise = options.dialate_engine == DialateEngine::FRONTIER;
+  unsigned char threshold = 0;
+  runner.measure("threshold", [&]() {
+    // The histogram only counts the ROI itself, not its halo.
+    threshold = select_threshold(pixels.view(), regions.local(regions.roi));
+
+    if (options.verbose) {
+      std::cout << "-calculating values... (t=" << static_cast<int>(threshold)
+                << ")" << std::endl;
+    }
+
+    apply_threshold(pixels.view(), threshold, parameters.certainty,
+                    regions.local(regions.mask), mask.view(),
+                    summarise ? &occupancy : nullptr);
+  });
+  return threshold;
+}
+
+int dialate_stage(StageRunner &runner, const StageRegions &regions,
+                  const StageParameters &parameters,
+                  const ImageBuffer<unsigned char> &mask,
+                  const OccupancyMap &occupancy,
+                  ImageView<unsigned char> output) {
+  const PipelineOptions &options = runner.options();
+  int iterations = 0;
+  runner.measure("dialate", [&]() {
+    DialateOptions dialate_options;
+    dialate_options.engine = options.dialate_engine;
+    dialate_options.count = parameters.denoise_count;
+    dialate_options.radius = parameters.denoise_radius;
+    if (options.dialate_engine == DialateEngine::FRONTIER) {
+      dialate_options.occupancy = &occupancy;
+    }
+    iterations = dialate(mask.view(), regions.local(regions.roi), output,
+                         dialate_options);
+  });
+
+  if (options.verbose && iterations < parameters.denoise_count) {
+    std::cout << "-dialate converged after " << iterations << " of "
+              << parameters.denoise_count << " passes" << std::endl;
+  }
+  return iterations;
+}
+
+ContentHasher hash_stage_input(ImageView<const unsigned char> input,
+                               int channels, const StageRegions &regions) {
+  ContentHasher hasher;
+  ImageView<const unsigned char> read = input.sub(regions.outer, channels);
+  for (size_t y = 0; y < read.height; ++y) {
+    hasher.add(read.row(y), read.width * channels);
+  }
+  hasher.add_value(input.width);
+  hasher.add_value(input.height);
+  hasher.add_value(channels);
+  return hasher;
+}
+
+StageKeys stage_keys(const ContentHasher &input, const StageRegions &regions,
+                     const PipelineOptions &options,
+                     const StageParameters &parameters) {
+  ContentHasher hasher = input;
+  // The mask region covers the dialate halo, which is clipped away on whole
+  // images, so changing the denoise parameters only misses for ROIs.
+  for (const Rect &rect : {regions.roi, regions.mask, regions.outer}) {
+    for (size_t value : {rect.x, rect.y, rect.width, rect.height}) {
+      hasher.add_value(value);
+    }
+  }
+  hasher.add_value(options.edges);
+  hasher.add_value(options.smoothing);
+  hasher.add_value(options.convolution);
+  hasher.add_value(parameters.blur_radius);
+  hasher.add_value(parameters.blur_count);
+
+  StageKeys keys;
+  keys.smoothed = hasher.key();
+  hasher.add_value(parameters.certainty);
+  hasher.add_value(parameters.denoise_count);
+  hasher.add_value(parameters.denoise_radius);
+  keys.mask = hasher.key();
+  return keys;
+}
+
+bool load_smoothed(StageCache &cache, const CacheKey &key,
+                   const StageRegions &regions, ImageBuffer<float> &pixels) {
+  CacheEntry entry;
+  Rect region = regions.local(regions.mask);
+  if (!cache.load(key, CacheEntry::GRAY, entry) ||
+      entry.width != region.width || entry.height != region.height) {
+    return false;
+  }
+  for (size_t y = 0; y < region.height; ++y) {
+    const unsigned char *row = &entry.pixels[y * region.width];
+    std::copy_n(row, region.width, pixels.row(region.y + y) + region.x);
+  }
+  return true;
+}
+
+void store_smoothed(StageCache &cache, const CacheKey &key,
+                    const StageRegions &regions,
+                    const ImageBuffer<float> &pixels) {
+  Rect region = regions.local(regions.mask);
+  CacheEntry entry;
+  entry.kind = CacheEntry::GRAY;
+  entry.width = region.width;
+  entry.height = region.height;
+  entry.pixels.reserve(region.area());
+  for (size_t y = 0; y < region.height; ++y) {
+    const float *row = pixels.row(region.y + y) + region.x;
+    for (size_t x = 0; x < region.width; ++x) {
+      // The same conversion thresholding applies.
+      entry.pixels.push_back(static_cast<unsigned char>(row[x]));
+    }
+  }
+  cache.store(key, entry);
+}
+
+bool load_mask(StageCache &cache, const CacheKey &key,
+               ImageView<unsigned char> mask, int &threshold,
+               int &dialate_iterations) {
+  CacheEntry entry;
+  if (!cache.load(key, CacheEntry::MASK, entry) ||
+      entry.width != mask.width || entry.height != mask.height) {
+    return false;
+  }
+  for (size_t y = 0; y < mask.height; ++y) {
+    std::copy_n(&entry.pixels[y * mask.width], mask.width, mask.row(y));
+  }
+  threshold = entry.threshold;
+  dialate_iterations = entry.dialate_iterations;
+  return true;
+}
+
+void store_mask(StageCache &cache, const CacheKey &key,
+                ImageView<const unsigned char> mask, int threshold,
+                int dialate_iterations) {
+  CacheEntry entry;
+  entry.kind = CacheEntry::MASK;
+  entry.width = mask.width;
+  entry.height = mask.height;
+  entry.threshold = threshold;
+  entry.dialate_iterations = dialate_iterations;
+  entry.pixels.reserve(mask.width * mask.height);
+  for (size_t y = 0; y < mask.height; ++y) {
+    entry.pixels.insert(entry.pixels.end(), mask.row(y),
+                        mask.row(y) + mask.width);
+  }
+  cache.store(key, entry);
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#include "pipeline.h"
+#include "stage_cache.h"
+
+// The pipeline's stages as separate steps, so that run_pipeline and
+// sweep_image run the same code: each stage takes its StageRunner, which
+// times it (and samples counters with perf) under the stage's name.
+
+// The regions a run restricted to `roi` computes: each stage only produces
+// what the stages after it will read, i.e. the ROI grown by their remaining
+// stencil radii and clipped to the image. Buffers cover `outer`, and since a
+// region is only ever clipped at the image edge, operators clamping at a
+// buffer edge behave exactly as they would on the whole image.
+struct StageRegions {
+  Rect roi;
+  // Thresholded and smoothed: what dialate reads.
+  Rect mask;
+  // The edge map smoothing reads.
+  Rect sobel;
+  // The blurred image sobel reads.
+  Rect blur;
+  // The grayscale image, and the extent of every buffer.
+  Rect outer;
+
+  // `rect` in the coordinates of buffers covering `outer`.
+  Rect local(const Rect &rect) const {
+    return Rect{rect.x - outer.x, rect.y - outer.y, rect.width, rect.height};
+  }
+};
+
+StageRegions stage_regions(const Rect &roi, size_t width, size_t height,
+                           const StageParameters &parameters);
+
+// What the stages of a run share. For its lifetime it applies the run-wide
+// options (thread options, huge pages, the buffer pool), and it opens the
+// performance counters and stage cache they ask for.
+class StageRunner {
+public:
+  StageRunner(const PipelineOptions &options, PipelineMetrics &metrics);
+  StageRunner(const StageRunner &) = delete;
+  StageRunner &operator=(const StageRunner &) = delete;
+
+  const PipelineOptions &options() const { return options_; }
+
+  // Records later stages into `metrics`, clearing its stages and counting
+  // buffer pool and cache use from here on.
+  void record_into(PipelineMetrics &metrics);
+
+  // Runs a stage, appending its timing (and counters) to the metrics.
+  void measure(const char *name, const std::function<void()> &stage);
+
+  // The stage cache, or null if options().cache_dir is empty.
+  StageCache *cache() { return cache_.get(); }
+
+  // Fills in the buffer pool, stage cache and peak RSS figures of the
+  // metrics.
+  void finish();
+
+private:
+  PipelineOptions options_;
+  PipelineMetrics *metrics_;
+  std::unique_ptr<PerfCounters> counters_;
+  ParallelContext parallel_;
+  BufferPool *pool_;
+  BufferPoolScope pool_scope_;
+  HugePagesScope huge_pages_scope_;
+  std::unique_ptr<StageCache> cache_;
+  size_t pool_hits_ = 0, pool_misses_ = 0;
+  size_t cache_hits_ = 0, cache_misses_ = 0;
+};
+
+// Reduces the input pixels of `regions.outer` into `gray` (reduce).
+void reduce_stage(StageRunner &runner, ImageView<const unsigned char> input,
+                  int channels, const StageRegions &regions,
+                  ImageBuffer<float> &gray);
+
+// Turns the grayscale image in `pixels` into the edge map in place, with
+// `scratch` as a second buffer (blur and sobel, or edges when separable).
+void edge_stage(StageRunner &runner, const StageRegions &regions,
+                const StageParameters &parameters, ImageBuffer<float> &pixels,
+                ImageBuffer<float> &scratch);
+
+// Smooths the edge map in `pixels` in place (smooth).
+void smooth_stage(StageRunner &runner, const StageRegions &regions,
+                  const StageParameters &parameters,
+                  ImageBuffer<float> &pixels, ImageBuffer<float> &scratch);
+
+// Picks the threshold over the ROI and thresholds the smoothed image into
+// `mask`, returning the threshold (threshold). With the frontier engine,
+// `occupancy` receives the tile summary of the mask.
+int threshold_stage(StageRunner &runner, const StageRegions &regions,
+                    const StageParameters &parameters,
+                    const ImageBuffer<float> &pixels,
+                    ImageBuffer<unsigned char> &mask,
+                    OccupancyMap &occupancy);
+
+// Dialates `mask` into `output` (ROI-sized) and returns the passes run
+// (dialate). `occupancy` is threshold_stage's summary of `mask`.
+int dialate_stage(StageRunner &runner, const StageRegions &regions,
+                  const StageParameters &parameters,
+                  const ImageBuffer<unsigned char> &mask,
+                  const OccupancyMap &occupancy,
+                  ImageView<unsigned char> output);
+
+// Stage cache keys for one set of parameters. The smoothed image depends on
+// the input pixels the run reads and the parameters of the stages up to
+// smoothing; the final mask also on those after it. Implementations that
+// give identical results (temporal blocking, the dialate engine) are left
+// out of the keys.
+struct StageKeys {
+  CacheKey smoothed;
+  CacheKey mask;
+};
+
+// Hashes the input pixels a run over `regions` reads, and the image
+// geometry; the start of every key for them.
+ContentHasher hash_stage_input(ImageView<const unsigned char> input,
+                               int channels, const StageRegions &regions);
+
+StageKeys stage_keys(const ContentHasher &input, const StageRegions &regions,
+                     const PipelineOptions &options,
+                     const StageParameters &parameters);
+
+// Loads a smoothed image over `regions.mask` into `pixels`, returning false
+// on a miss. The cache holds the 8-bit values thresholding reads, so the
+// result thresholds exactly like the image that was stored.
+bool load_smoothed(StageCache &cache, const CacheKey &key,
+                   const StageRegions &regions, ImageBuffer<float> &pixels);
+void store_smoothed(StageCache &cache, const CacheKey &key,
+                    const StageRegions &regions,
+                    const ImageBuffer<float> &pixels);
+
+// Loads a final mask into `mask` (ROI-sized) with the threshold and dialate
+// passes that produced it, returning false on a miss.
+bool load_mask(StageCache &cache, const CacheKey &key,
+               ImageView<unsigned char> mask, int &threshold,
+               int &dialate_iterations);
+void store_mask(StageCache &cache, const CacheKey &key,
+                ImageView<const unsigned char> mask, int threshold,
+                int dialate_iterations);
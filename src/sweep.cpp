@@ -0,0 +1,355 @@
+#include "sweep.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include "stb/stb_image.h"
+
+#include "stages.h"
+
+namespace {
+
+// The options add_sweep_axis accepts: the StageParameters ones.
+const char *const SWEEPABLE[] = {"denoise-count", "denoise-radius",
+                                 "blur-count", "blur-radius", "certainty"};
+
+// One combination of the sweep, resolved into full options.
+struct Combination {
+  std::vector<std::string> settings;
+  PipelineOptions options;
+};
+
+// Every combination, the last axis varying fastest.
+std::vector<Combination> expand(const ParameterSweep &sweep,
+                                const PipelineOptions &options) {
+  std::vector<Combination> combinations{{{}, options}};
+  for (const auto &axis : sweep.axes) {
+    std::vector<Combination> next;
+    for (const Combination &combination : combinations) {
+      for (const std::string &value : axis.second) {
+        Combination extended = combination;
+        set_option(extended.options, axis.first, value);
+        extended.settings.push_back(axis.first + "=" + value);
+        next.push_back(std::move(extended));
+      }
+    }
+    combinations = std::move(next);
+  }
+  for (const Combination &combination : combinations) {
+    check_parameters(combination.options.parameters);
+  }
+  return combinations;
+}
+
+// The parameters each stage output depends on, in the order the stages run.
+// A combination's prefix of these keys identifies the outputs it can reuse.
+auto edge_key(const StageParameters &p) {
+  return std::make_tuple(p.blur_radius);
+}
+auto smooth_key(const StageParameters &p) {
+  return std::make_tuple(p.blur_radius, p.blur_count);
+}
+auto mask_key(const StageParameters &p) {
+  return std::make_tuple(p.blur_radius, p.blur_count, p.certainty);
+}
+auto full_key(const StageParameters &p) {
+  return std::make_tuple(p.blur_radius, p.blur_count, p.certainty,
+                         p.denoise_radius, p.denoise_count);
+}
+
+// `path` with "_name-value" for every swept setting before its extension.
+std::string output_name(const std::string &path,
+                        const std::vector<std::string> &settings) {
+  std::string suffix;
+  for (const std::string &setting : settings) {
+    std::string part = setting;
+    std::replace(part.begin(), part.end(), '=', '-');
+    suffix += "_" + part;
+  }
+  size_t extension = path.rfind('.');
+  std::string name = path;
+  name.insert(extension == std::string::npos ? name.size() : extension,
+              suffix);
+  return name;
+}
+
+} // namespace
+
+size_t ParameterSweep::size() const {
+  size_t count = 1;
+  for (const auto &axis : axes) {
+    count *= axis.second.size();
+  }
+  return count;
+}
+
+void add_sweep_axis(ParameterSweep &sweep, const std::string &text) {
+  size_t split = text.find('=');
+  if (split == std::string::npos || split + 1 == text.size()) {
+    throw std::invalid_argument("expected name=value,value,..., got " + text);
+  }
+  std::string name = text.substr(0, split);
+  if (std::find(std::begin(SWEEPABLE), std::end(SWEEPABLE), name) ==
+      std::end(SWEEPABLE)) {
+    throw std::invalid_argument("cannot sweep option " + name);
+  }
+  for (const auto &axis : sweep.axes) {
+    if (axis.first == name) {
+      throw std::invalid_argument("option " + name + " swept twice");
+    }
+  }
+
+  std::vector<std::string> values;
+  std::istringstream list(text.substr(split + 1));
+  std::string value;
+  while (std::getline(list, value, ',')) {
+    // Checked here so a bad value fails before any work is done.
+    PipelineOptions scratch;
+    set_option(scratch, name, value);
+    values.push_back(value);
+  }
+  sweep.axes.emplace_back(name, std::move(values));
+}
+
+std::vector<SweepResult> sweep_image(const char *file_path,
+                                     const char *output_path,
+                                     const PipelineOptions &options,
+                                     const ParameterSweep &sweep) {
+  std::vector<Combination> combinations = expand(sweep, options);
+  std::stable_sort(combinations.begin(), combinations.end(),
+                   [](const Combination &a, const Combination &b) {
+                     return full_key(a.options.parameters) <
+                            full_key(b.options.parameters);
+                   });
+
+  int width, height, channels;
+  std::unique_ptr<unsigned char, void (*)(void *)> image(
+      stbi_load(file_path, &width, &height, &channels, 0), stbi_image_free);
+  if (!image) {
+    throw std::runtime_error("unable to load image");
+  }
+  ImageView<const unsigned char> input(image.get(), width, height,
+                                       static_cast<size_t>(width) * channels);
+
+  // Whole images need no halos, so the regions are the same for every
+  // combination.
+  Rect whole{0, 0, input.width, input.height};
+  StageRegions regions =
+      stage_regions(whole, input.width, input.height, options.parameters);
+
+  PipelineMetrics shared;
+  StageRunner runner(options, shared);
+  StageCache *cache = runner.cache();
+  ImageBuffer<float> gray(width, height), edges(width, height),
+      smoothed(width, height), scratch(width, height);
+  ImageBuffer<unsigned char> mask(width, height), output(width, height);
+
+  // The grayscale image and input hash are shared by every combination; the
+  // decoded file is not needed after them.
+  ContentHasher input_hash;
+  reduce_stage(runner, input, channels, regions, gray);
+  if (cache) {
+    runner.measure("hash", [&]() {
+      input_hash = hash_stage_input(input, channels, regions);
+    });
+  }
+  image.reset();
+
+  // The time of the stages recorded into `metrics` while `stages` runs.
+  auto timed = [](const PipelineMetrics &metrics, auto stages) {
+    size_t first = metrics.stages.size();
+    stages();
+    double seconds = 0;
+    for (size_t i = first; i < metrics.stages.size(); ++i) {
+      seconds += metrics.stages[i].seconds;
+    }
+    return seconds;
+  };
+  double shared_seconds = 0;
+  for (const StageMetrics &stage : shared.stages) {
+    shared_seconds += stage.seconds;
+  }
+
+  // The most recent output of each stage and what it cost. Combinations are
+  // sorted by full_key, so every output is only needed until a combination
+  // with a different prefix comes along.
+  bool have_edges = false, have_smoothed = false, have_mask = false;
+  decltype(edge_key(StageParameters())) edges_for;
+  decltype(smooth_key(StageParameters())) smoothed_for;
+  decltype(mask_key(StageParameters())) mask_for;
+  double edges_seconds = 0, smooth_seconds = 0, mask_seconds = 0;
+  int threshold = 0;
+  OccupancyMap occupancy;
+
+  std::vector<SweepResult> results;
+  for (const Combination &combination : combinations) {
+    const StageParameters &parameters = combination.options.parameters;
+    SweepResult result;
+    result.settings = combination.settings;
+    result.parameters = parameters;
+    result.output_path = output_name(output_path, combination.settings);
+    PipelineMetrics &metrics = result.metrics;
+    runner.record_into(metrics);
+    metrics.pixel_count = whole.area();
+    if (results.empty()) {
+      metrics.stages = shared.stages;
+    }
+
+    if (options.verbose) {
+      std::cout << "-sweep " << results.size() + 1 << " of "
+                << combinations.size() << ":";
+      for (const std::string &setting : combination.settings) {
+        std::cout << " " << setting;
+      }
+      std::cout << std::endl;
+    }
+
+    // Each stage output is computed only if a later one needs it and the
+    // one kept from an earlier combination was made with other parameters.
+    StageKeys keys;
+    bool smoothed_fresh = false;
+    auto need_edges = [&]() {
+      if (have_edges && edges_for == edge_key(parameters)) {
+        return;
+      }
+      edges_seconds = timed(metrics, [&]() {
+        for (size_t y = 0; y < gray.height(); ++y) {
+          std::copy_n(gray.row(y), gray.width(), edges.row(y));
+        }
+        edge_stage(runner, regions, parameters, edges, scratch);
+      });
+      have_edges = true;
+      edges_for = edge_key(parameters);
+    };
+    auto need_smoothed = [&]() {
+      if (have_smoothed && smoothed_for == smooth_key(parameters)) {
+        return;
+      }
+      bool loaded = false;
+      smooth_seconds = timed(metrics, [&]() {
+        if (cache) {
+          runner.measure("cache-load", [&]() {
+            loaded = load_smoothed(*cache, keys.smoothed, regions, smoothed);
+          });
+        }
+      });
+      if (!loaded) {
+        need_edges();
+        // smooth works in place, and the edge map may still be needed.
+        auto compute = [&]() {
+          for (size_t y = 0; y < edges.height(); ++y) {
+            std::copy_n(edges.row(y), edges.width(), smoothed.row(y));
+          }
+          smooth_stage(runner, regions, parameters, smoothed, scratch);
+        };
+        smooth_seconds += edges_seconds + timed(metrics, compute);
+        smoothed_fresh = true;
+      }
+      have_smoothed = true;
+      smoothed_for = smooth_key(parameters);
+      have_mask = false;
+    };
+    auto need_mask = [&]() {
+      if (have_mask && mask_for == mask_key(parameters)) {
+        return;
+      }
+      need_smoothed();
+      auto compute = [&]() {
+        threshold = threshold_stage(runner, regions, parameters, smoothed,
+                                    mask, occupancy);
+      };
+      mask_seconds = smooth_seconds + timed(metrics, compute);
+      have_mask = true;
+      mask_for = mask_key(parameters);
+    };
+
+    bool loaded = false;
+    double dialate_seconds = timed(metrics, [&]() {
+      if (cache) {
+        runner.measure("cache", [&]() {
+          keys = stage_keys(input_hash, regions, options, parameters);
+          loaded = load_mask(*cache, keys.mask, output.view(),
+                             result.threshold, result.dialate_iterations);
+        });
+      }
+    });
+    if (loaded) {
+      result.standalone_seconds = shared_seconds + dialate_seconds;
+    } else {
+      need_mask();
+      dialate_seconds += timed(metrics, [&]() {
+        result.dialate_iterations = dialate_stage(
+            runner, regions, parameters, mask, occupancy, output.view());
+      });
+      result.threshold = threshold;
+      if (cache) {
+        runner.measure("cache-store", [&]() {
+          if (smoothed_fresh) {
+            store_smoothed(*cache, keys.smoothed, regions, smoothed);
+          }
+          store_mask(*cache, keys.mask, output.view(), result.threshold,
+                     result.dialate_iterations);
+        });
+      }
+      result.standalone_seconds =
+          shared_seconds + mask_seconds + dialate_seconds;
+    }
+
+    runner.finish();
+    for (const StageMetrics &stage : metrics.stages) {
+      result.seconds += stage.seconds;
+    }
+    if (options.perf_counters) {
+      print_stage_report(metrics);
+    }
+
+    write_mask(result.output_path, output.view());
+    results.push_back(std::move(result));
+  }
+
+  return results;
+}
+
+void print_sweep_report(const std::vector<SweepResult> &results) {
+  auto describe = [](const SweepResult &result) {
+    std::string settings;
+    for (const std::string &setting : result.settings) {
+      settings += (settings.empty() ? "-" : " ") + setting;
+    }
+    return settings;
+  };
+  size_t column = 10;
+  for (const SweepResult &result : results) {
+    column = std::max(column, describe(result).size() + 2);
+  }
+
+  double total = 0, standalone = 0;
+  std::cout << std::left << std::setw(column) << "-settings" << std::right
+            << std::setw(4) << "t" << std::setw(8) << "passes"
+            << std::setw(10) << "ms" << std::setw(14) << "standalone ms"
+            << "  output" << std::endl;
+
+  for (const SweepResult &result : results) {
+    std::cout << std::left << std::setw(column) << describe(result)
+              << std::right
+              << std::setw(4) << result.threshold << std::setw(8)
+              << result.dialate_iterations << std::fixed
+              << std::setprecision(2) << std::setw(10)
+              << result.seconds * 1000.0 << std::setw(14)
+              << result.standalone_seconds * 1000.0 << "  "
+              << result.output_path << std::endl;
+    total += result.seconds;
+    standalone += result.standalone_seconds;
+  }
+
+  std::cout << "-sweep total: " << std::fixed << std::setprecision(2)
+            << total * 1000.0 << " ms for " << results.size()
+            << " combinations (" << standalone * 1000.0
+            << " ms as separate runs)" << std::endl;
+  std::cout << std::defaultfloat << std::setprecision(6);
+}
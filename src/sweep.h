@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pipeline.h"
+
+// Values to try for stage parameters, by their set_option names (e.g.
+// "certainty" -> {"3", "5", "7"}). Every combination is run.
+struct ParameterSweep {
+  std::vector<std::pair<std::string, std::vector<std::string>>> axes;
+
+  bool empty() const { return axes.empty(); }
+  // The number of combinations.
+  size_t size() const;
+};
+
+// Adds an axis from "name=value,value,..." as used by --sweep. Only the
+// StageParameters options (denoise-count, denoise-radius, blur-count,
+// blur-radius, certainty) can be swept, each at most once. Throws
+// std::invalid_argument.
+void add_sweep_axis(ParameterSweep &sweep, const std::string &text);
+
+// One combination of a sweep and what running it cost.
+struct SweepResult {
+  // The swept values, in axis order, as "name=value".
+  std::vector<std::string> settings;
+  StageParameters parameters;
+  std::string output_path;
+  int threshold = 0;
+  int dialate_iterations = 0;
+  // The stages run for this combination, not counting the ones it reused
+  // from earlier combinations; the first combination also carries the shared
+  // grayscale stage.
+  PipelineMetrics metrics;
+  // The time of those stages.
+  double seconds = 0;
+  // Time of every stage this combination depends on, reused or not: roughly
+  // what a separate run of the pipeline would have taken.
+  double standalone_seconds = 0;
+};
+
+// Runs the pipeline on an image once per combination of `sweep` (on top of
+// `options`) and writes each mask to `output_path` with the swept settings
+// inserted before the extension, e.g. output_1_certainty-5.png.
+//
+// The stages form a chain whose outputs depend on a growing set of
+// parameters: the edge map on blur-radius, the smoothed image also on
+// blur-count, the thresholded mask also on certainty and the dialated mask
+// on everything. Combinations are visited in that order of keys, so that
+// each stage output is computed once and reused by every combination that
+// shares its prefix of parameters; the grayscale image is computed once in
+// all. With a stage cache (PipelineOptions::cache_dir), smoothed images and
+// masks are also loaded from and stored to it, and with perf a stage report
+// is printed per combination.
+std::vector<SweepResult> sweep_image(const char *file_path,
+                                     const char *output_path,
+                                     const PipelineOptions &options,
+                                     const ParameterSweep &sweep);
+
+// Prints one line per combination: its settings, threshold, dialate passes,
+// incremental and standalone time, and output file.
+void print_sweep_report(const std::vector<SweepResult> &results);
@@ -0,0 +1,602 @@
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "image_analysis.h"
+#include "pipeline.h"
+#include "synthesize.h"
+
+// Regression checks for the pipeline's interchangeable implementations: each
+// one computes the same result two ways on small synthetic images (see
+// bench/synthesize.h), for the default parameters and a non-default set, and
+// compares them. Exits with 1 if any check fails.
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Largest deviation allowed between smoothing implementations that are equal
+// up to float rounding, in 8-bit pixel values.
+constexpr double SMOOTHING_TOLERANCE = 1e-3;
+// The same for edge magnitudes, which reach several times 255.
+constexpr double EDGE_TOLERANCE = 1e-2;
+
+constexpr SynthImage TEST_IMAGES[] = {
+    // Scattered text-like runs: sparse masks, many empty dialate tiles.
+    {"document", 640, 480, 800, 12},
+    // Dense, noisy features: masks cover most of the image.
+    {"texture", 512, 384, 2400, 30},
+};
+
+int failures = 0;
+
+void check(bool passed, const std::string &what) {
+  std::cout << (passed ? "-ok " : "-FAILED ") << what << std::endl;
+  failures += !passed;
+}
+
+struct TestImage {
+  SynthImage spec;
+  std::vector<unsigned char> pixels;
+
+  size_t width() const { return spec.width; }
+  size_t height() const { return spec.height; }
+  Rect bounds() const { return Rect{0, 0, width(), height()}; }
+  ImageView<const unsigned char> view() const {
+    return {pixels.data(), width(), height(), width() * 3};
+  }
+};
+
+bool same_mask(ImageView<const unsigned char> a,
+               ImageView<const unsigned char> b) {
+  if (a.width != b.width || a.height != b.height) {
+    return false;
+  }
+  for (size_t y = 0; y < a.height; ++y) {
+    if (!std::equal(a.row(y), a.row(y) + a.width, b.row(y))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ImageBuffer<unsigned char> run_mask(const TestImage &image,
+                                    const PipelineOptions &options,
+                                    const Rect &roi,
+                                    PipelineMetrics &metrics) {
+  ImageBuffer<unsigned char> mask(roi.width, roi.height);
+  run_pipeline(image.view(), 3, roi, mask.view(), options, metrics);
+  return mask;
+}
+
+ImageBuffer<unsigned char> run_mask(const TestImage &image,
+                                    const PipelineOptions &options) {
+  PipelineMetrics metrics;
+  return run_mask(image, options, image.bounds(), metrics);
+}
+
+double max_deviation(const ImageBuffer<float> &reference,
+                     const ImageBuffer<float> &candidate,
+                     const StageParameters &parameters) {
+  SmoothingDeviation deviation = compare_smoothing(
+      reference.view(), candidate.view(), composite_radius(parameters));
+  return std::max(deviation.border_max, deviation.interior_max);
+}
+
+void check_engines(const TestImage &image, const PipelineOptions &options) {
+  PipelineOptions frontier = options;
+  frontier.dialate_engine = DialateEngine::FRONTIER;
+  check(same_mask(run_mask(image, options).view(),
+                  run_mask(image, frontier).view()),
+        "frontier dialate == sweep dialate");
+}
+
+// Work stealing hands rows to whichever thread is free, which must not change
+// the mask: every schedule and thread count gives the serial result, here
+// with the frontier engine, whose work per row varies the most.
+void check_schedules(const TestImage &image, const PipelineOptions &options) {
+  PipelineOptions serial = options;
+  serial.parallel.threads = 1;
+  ImageBuffer<unsigned char> expected = run_mask(image, serial);
+
+  bool same = true;
+  for (Schedule schedule : {Schedule::STATIC, Schedule::STEALING}) {
+    for (size_t threads : {3, 8}) {
+      PipelineOptions parallel = options;
+      parallel.parallel.schedule = schedule;
+      parallel.parallel.threads = threads;
+      parallel.dialate_engine = DialateEngine::FRONTIER;
+      same = same &&
+             same_mask(expected.view(), run_mask(image, parallel).view());
+    }
+  }
+  check(same, "static and stealing schedules == one thread");
+}
+
+void check_smoothing(const TestImage &image,
+                     const StageParameters &parameters) {
+  ImageBuffer<float> gray(image.width(), image.height());
+  reduce_channels(image.view(), 3, gray.view());
+
+  auto smoothed = [&](SmoothingMode mode) {
+    ImageBuffer<float> pixels(image.width(), image.height()),
+        scratch(image.width(), image.height());
+    for (size_t y = 0; y < image.height(); ++y) {
+      std::copy_n(gray.row(y), image.width(), pixels.row(y));
+    }
+    smooth(pixels, scratch, image.bounds(), mode, parameters);
+    return pixels;
+  };
+  double deviation =
+      max_deviation(smoothed(SmoothingMode::ITERATED),
+                    smoothed(SmoothingMode::RUNNING_SUM), parameters);
+  check(deviation <= SMOOTHING_TOLERANCE,
+        "running-sum smoothing ~ iterated (max deviation " +
+            std::to_string(deviation) + ")");
+
+  auto composite = [&](ConvolutionBackend backend) {
+    ImageBuffer<float> output(image.width(), image.height());
+    smooth_composite(gray.view(), output.view(), image.bounds(), parameters,
+                     backend);
+    return output;
+  };
+  // Only the interior: at the border the composite kernel renormalises once
+  // rather than per pass.
+  deviation = compare_smoothing(smoothed(SmoothingMode::ITERATED).view(),
+                                composite(ConvolutionBackend::DIRECT).view(),
+                                composite_radius(parameters))
+                  .interior_max;
+  check(deviation <= SMOOTHING_TOLERANCE,
+        "composite smoothing ~ iterated away from the border (max deviation " +
+            std::to_string(deviation) + ")");
+
+  deviation = max_deviation(composite(ConvolutionBackend::DIRECT),
+                            composite(ConvolutionBackend::FFT), parameters);
+  check(deviation <= SMOOTHING_TOLERANCE,
+        "FFT composite ~ direct (max deviation " + std::to_string(deviation) +
+            ")");
+}
+
+// A 0/255 mask of the image's dark pixels: dense strokes along with
+// isolated noise pixels for dialate to remove.
+ImageBuffer<unsigned char> dark_mask(const TestImage &image) {
+  ImageBuffer<float> gray(image.width(), image.height());
+  reduce_channels(image.view(), 3, gray.view());
+  ImageBuffer<unsigned char> mask(image.width(), image.height());
+  for (size_t y = 0; y < image.height(); ++y) {
+    for (size_t x = 0; x < image.width(); ++x) {
+      mask.row(y)[x] = gray.row(y)[x] < 128 ? 255 : 0;
+    }
+  }
+  return mask;
+}
+
+// The kernels specialised for a FixedRadius must give exactly what the
+// generic RuntimeRadius code behind blur_operator and dialate_operator gives.
+void check_specialised(const TestImage &image) {
+  ImageBuffer<float> gray(image.width(), image.height());
+  reduce_channels(image.view(), 3, gray.view());
+  ImageBuffer<unsigned char> mask = dark_mask(image);
+  ImageBuffer<float> binary(image.width(), image.height());
+  for (size_t y = 0; y < image.height(); ++y) {
+    std::copy_n(mask.row(y), image.width(), binary.row(y));
+  }
+
+  auto same_output = [&](const ImageBuffer<float> &input,
+                         KernelFunc specialised, KernelFunc generic) {
+    ImageBuffer<float> a(image.width(), image.height()),
+        b(image.width(), image.height());
+    apply_kernel(input.view(), a.view(), specialised);
+    apply_kernel(input.view(), b.view(), generic);
+    for (size_t y = 0; y < image.height(); ++y) {
+      if (!std::equal(a.row(y), a.row(y) + image.width(), b.row(y))) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  bool same = true;
+  for (int radius : {1, 3, 9}) {
+    same = same &&
+           same_output(gray, blur_kernel(radius),
+                       [radius](ImageView<const float> input, int x, int y) {
+                         return blur_operator(input, x, y, radius);
+                       }) &&
+           same_output(binary, dialate_kernel(radius),
+                       [radius](ImageView<const float> input, int x, int y) {
+                         return dialate_operator(input, x, y, radius);
+                       });
+  }
+  check(same, "specialised radius kernels == generic kernels");
+}
+
+// The fused edge stage's two separable filters must give the blur stencil
+// followed by the Sobel stencil, up to float rounding, edges included.
+void check_edges(const TestImage &image, const StageParameters &parameters) {
+  ImageBuffer<float> gray(image.width(), image.height()),
+      blurred(image.width(), image.height()),
+      stencil(image.width(), image.height()),
+      separable(image.width(), image.height());
+  reduce_channels(image.view(), 3, gray.view());
+
+  apply_kernel(gray.view(), blurred.view(),
+               blur_kernel(parameters.blur_radius));
+  apply_kernel(blurred.view(), stencil.view(), sobel_operator);
+  apply_separable_abs_sum(gray.view(), separable.view(), image.bounds(),
+                          blurred_sobel_filters(parameters.blur_radius));
+
+  double deviation = 0;
+  for (size_t y = 0; y < image.height(); ++y) {
+    for (size_t x = 0; x < image.width(); ++x) {
+      deviation = std::max(
+          deviation, std::abs(static_cast<double>(stencil.row(y)[x]) -
+                              separable.row(y)[x]));
+    }
+  }
+  check(deviation <= EDGE_TOLERANCE,
+        "separable edges ~ blur and Sobel stencils (max deviation " +
+            std::to_string(deviation) + ")");
+}
+
+// The 8-bit dialate counts set pixels where the original passes averaged
+// float ones; both engines must give exactly the float passes' mask.
+void check_dialate(const TestImage &image,
+                   const StageParameters &parameters) {
+  ImageBuffer<unsigned char> mask = dark_mask(image);
+
+  ImageBuffer<float> pixels(image.width(), image.height()),
+      scratch(image.width(), image.height());
+  for (size_t y = 0; y < image.height(); ++y) {
+    std::copy_n(mask.row(y), image.width(), pixels.row(y));
+  }
+  for (int i = 0; i < parameters.denoise_count; ++i) {
+    apply_kernel(pixels.view(), scratch.view(),
+                 dialate_kernel(parameters.denoise_radius));
+    for (size_t y = 0; y < image.height(); ++y) {
+      for (size_t x = 0; x < image.width(); ++x) {
+        pixels.row(y)[x] = scratch.row(y)[x] > 127 ? 255 : 0;
+      }
+    }
+  }
+
+  bool same = true;
+  for (DialateEngine engine : {DialateEngine::SWEEP, DialateEngine::FRONTIER}) {
+    DialateOptions options;
+    options.engine = engine;
+    options.count = parameters.denoise_count;
+    options.radius = parameters.denoise_radius;
+    ImageBuffer<unsigned char> dialated(image.width(), image.height());
+    dialate(mask.view(), dialated.view(), options);
+    for (size_t y = 0; y < image.height(); ++y) {
+      same = same && std::equal(dialated.row(y),
+                                dialated.row(y) + image.width(),
+                                pixels.row(y));
+    }
+  }
+  check(same, "8-bit dialate == float dialate_operator passes");
+}
+
+// The pipeline's mask before dialate: edges, smoothed with running sums
+// and thresholded as threshold_stage does.
+ImageBuffer<unsigned char> threshold_mask(const TestImage &image,
+                                          const StageParameters &parameters) {
+  ImageBuffer<float> gray(image.width(), image.height()),
+      pixels(image.width(), image.height()),
+      scratch(image.width(), image.height());
+  reduce_channels(image.view(), 3, gray.view());
+  apply_separable_abs_sum(gray.view(), pixels.view(), image.bounds(),
+                          blurred_sobel_filters(parameters.blur_radius));
+  smooth(pixels, scratch, image.bounds(), SmoothingMode::RUNNING_SUM,
+         parameters);
+  ImageBuffer<unsigned char> mask(image.width(), image.height());
+  apply_threshold(pixels.view(), select_threshold(pixels.view(),
+                                                  image.bounds()),
+                  parameters.certainty, image.bounds(), mask.view());
+  return mask;
+}
+
+// Stopping at the fixed point must give the mask that running every pass
+// does, here one single-pass dialate after another. The pass budget is
+// generous so that the masks reach their fixed point well within it.
+void check_convergence(const TestImage &image,
+                       const StageParameters &parameters) {
+  ImageBuffer<unsigned char> mask = threshold_mask(image, parameters);
+  int count = parameters.denoise_count * 8;
+
+  ImageBuffer<unsigned char> every_pass(image.width(), image.height());
+  DialateOptions single;
+  single.count = 1;
+  single.radius = parameters.denoise_radius;
+  dialate(mask.view(), every_pass.view(), single);
+  for (int i = 1; i < count; ++i) {
+    dialate(every_pass.view(), every_pass.view(), single);
+  }
+
+  bool same = true;
+  std::string passes;
+  for (DialateEngine engine : {DialateEngine::SWEEP, DialateEngine::FRONTIER}) {
+    DialateOptions options;
+    options.engine = engine;
+    options.count = count;
+    options.radius = parameters.denoise_radius;
+    ImageBuffer<unsigned char> dialated(image.width(), image.height());
+    passes += (passes.empty() ? "" : " and ") +
+              std::to_string(dialate(mask.view(), dialated.view(), options));
+    same = same && same_mask(dialated.view(), every_pass.view());
+  }
+  check(same, "dialate stopped at its fixed point == every pass (" + passes +
+                  " of " + std::to_string(count) + " passes)");
+}
+
+// Temporal blocking recomputes each tile's halo instead of sharing it, which
+// must not change a single value: every depth, tile size and region gives the
+// plain loop's result exactly.
+void check_blocking(const TestImage &image,
+                    const StageParameters &parameters) {
+  ImageBuffer<float> gray(image.width(), image.height());
+  reduce_channels(image.view(), 3, gray.view());
+
+  auto blurred = [&](const Rect &region, const BlockingOptions &blocking) {
+    ImageBuffer<float> pixels(image.width(), image.height()),
+        scratch(image.width(), image.height());
+    for (size_t y = 0; y < image.height(); ++y) {
+      std::copy_n(gray.row(y), image.width(), pixels.row(y));
+    }
+    apply_kernel_n(pixels, scratch, blur_kernel(parameters.blur_radius),
+                   parameters.blur_radius, parameters.blur_count, region,
+                   blocking);
+    return pixels;
+  };
+
+  Rect inner{image.width() / 5, image.height() / 4, image.width() / 2,
+             image.height() / 3};
+  bool same = true;
+  for (const Rect &region : {image.bounds(), inner}) {
+    ImageBuffer<float> plain = blurred(region, BlockingOptions{});
+    for (const BlockingOptions &blocking :
+         {BlockingOptions{2, 29}, BlockingOptions{3, 64},
+          BlockingOptions{5, 128}}) {
+      ImageBuffer<float> blocked = blurred(region, blocking);
+      for (size_t y = region.y; y < region.y + region.height; ++y) {
+        same = same && std::equal(plain.row(y) + region.x,
+                                  plain.row(y) + region.x + region.width,
+                                  blocked.row(y) + region.x);
+      }
+    }
+  }
+  check(same, "blocked blur passes == plain passes");
+}
+
+void check_roi(const TestImage &image, const PipelineOptions &options) {
+  PipelineMetrics full_metrics;
+  ImageBuffer<unsigned char> full =
+      run_mask(image, options, image.bounds(), full_metrics);
+  // The middle third, so that (most of) the halo above and below it is
+  // computed rather than clipped at the image edge, and a region inside the
+  // image that also has halo columns to either side.
+  Rect band{0, image.height() / 3, image.width(), image.height() / 3};
+  Rect inner{image.width() / 4, image.height() / 3, image.width() * 2 / 3,
+             image.height() / 2};
+  for (const Rect &roi : {band, inner}) {
+    PipelineMetrics roi_metrics;
+    ImageBuffer<unsigned char> cropped =
+        run_mask(image, options, roi, roi_metrics);
+    // The ROI picks its own threshold, so the crops can only agree if it is
+    // the same one; the test images are chosen so that it is.
+    check(roi_metrics.threshold == full_metrics.threshold &&
+              same_mask(cropped.view(), full.view().sub(roi)),
+          "ROI " + std::to_string(roi.width) + "x" +
+              std::to_string(roi.height) + " run == crop of full run " +
+              "(thresholds " + std::to_string(roi_metrics.threshold) +
+              " and " + std::to_string(full_metrics.threshold) + ")");
+  }
+}
+
+// Pipelines started from several threads at once share the worker pool with
+// whichever gets it first; the others run on threads of their own.
+void check_concurrent(const TestImage &image, const PipelineOptions &options) {
+  ImageBuffer<unsigned char> expected = run_mask(image, options);
+  std::vector<ImageBuffer<unsigned char>> masks(4);
+  std::vector<std::thread> callers;
+  for (ImageBuffer<unsigned char> &mask : masks) {
+    callers.emplace_back([&]() { mask = run_mask(image, options); });
+  }
+  bool same = true;
+  for (size_t i = 0; i < callers.size(); ++i) {
+    callers[i].join();
+    same = same && same_mask(expected.view(), masks[i].view());
+  }
+  check(same, "concurrent pipelines == one pipeline");
+}
+
+// The calling thread's buffer pool keeps no more than buffer-pool-size
+// between runs, and ia_release_buffers empties it.
+void check_buffer_pool(const TestImage &image, PipelineOptions options) {
+  options.buffer_pool_megabytes = 1;
+  run_mask(image, options);
+  bool capped = BufferPool::thread_pool().retained_bytes() <= (1 << 20);
+  ia_release_buffers();
+  check(capped && BufferPool::thread_pool().retained_bytes() == 0,
+        "buffer pool stays within its size and is released");
+}
+
+void check_cache(const TestImage &image, const PipelineOptions &options,
+                 const fs::path &directory) {
+  fs::remove_all(directory);
+  PipelineOptions cached = options;
+  cached.cache_dir = directory.string();
+
+  ImageBuffer<unsigned char> uncached = run_mask(image, options);
+  PipelineMetrics storing, loading;
+  ImageBuffer<unsigned char> stored =
+      run_mask(image, cached, image.bounds(), storing);
+  ImageBuffer<unsigned char> loaded =
+      run_mask(image, cached, image.bounds(), loading);
+  check(same_mask(uncached.view(), stored.view()) &&
+            same_mask(uncached.view(), loaded.view()) &&
+            loading.cache_hits > 0,
+        "cached run == uncached run");
+
+  // Pipelines on several threads storing the same entries at once.
+  fs::remove_all(directory);
+  std::vector<ImageBuffer<unsigned char>> masks(4);
+  std::vector<std::thread> callers;
+  for (ImageBuffer<unsigned char> &mask : masks) {
+    callers.emplace_back([&]() { mask = run_mask(image, cached); });
+  }
+  bool same = true;
+  for (size_t i = 0; i < callers.size(); ++i) {
+    callers[i].join();
+    same = same && same_mask(uncached.view(), masks[i].view());
+  }
+  loaded = run_mask(image, cached, image.bounds(), loading);
+  check(same && same_mask(uncached.view(), loaded.view()),
+        "concurrently cached runs == uncached run");
+}
+
+void write_ppm(const fs::path &path, const TestImage &image) {
+  std::ofstream file(path, std::ios::binary);
+  file << "P6\n" << image.width() << " " << image.height() << "\n255\n";
+  file.write(reinterpret_cast<const char *>(image.pixels.data()),
+             image.pixels.size());
+  if (!file) {
+    throw std::runtime_error("unable to write " + path.string());
+  }
+}
+
+// A journal whose last line was cut short by a crash: the next run must
+// ignore that line, redo its input, and leave a journal the run after can
+// read in full.
+void check_journal(const std::vector<TestImage> &images,
+                   const PipelineOptions &options,
+                   const fs::path &directory) {
+  fs::remove_all(directory);
+  fs::create_directories(directory);
+
+  std::vector<std::string> files;
+  for (const TestImage &image : images) {
+    files.push_back((directory / image.spec.name).string() + ".ppm");
+    write_ppm(files.back(), image);
+  }
+  BatchOptions batch;
+  batch.output_dir = (directory / "out").string();
+  batch.journal = (directory / "journal").string();
+
+  std::vector<std::string> first(files.begin(), files.end() - 1);
+  BatchSummary summary = run_batch(first, options, {}, batch);
+  bool recovered = summary.processed == first.size();
+
+  std::ofstream(batch.journal, std::ios::app) << files.back() << "\tout";
+  summary = run_batch(files, options, {}, batch);
+  recovered = recovered && summary.processed == 1 &&
+              summary.skipped == first.size();
+
+  summary = run_batch(files, options, {}, batch);
+  recovered =
+      recovered && summary.processed == 0 && summary.skipped == files.size();
+  check(recovered, "torn journal line is redone and the journal recovers");
+
+  // The same inputs, spelled differently.
+  std::vector<std::string> respelled;
+  for (const TestImage &image : images) {
+    respelled.push_back((directory / "out" / ".." / image.spec.name).string() +
+                        ".ppm");
+  }
+  summary = run_batch(respelled, options, {}, batch);
+  check(summary.processed == 0 && summary.skipped == files.size(),
+        "journal matches inputs by canonical path");
+}
+
+// A black image has no pixels to pick a threshold from. The batch must report
+// it and go on with the next input, and leave it out of the journal so a
+// rerun tries it again.
+void check_batch_failure(const TestImage &image,
+                         const PipelineOptions &options,
+                         const fs::path &directory) {
+  fs::remove_all(directory);
+  fs::create_directories(directory);
+
+  TestImage black{image.spec,
+                  std::vector<unsigned char>(image.pixels.size(), 0)};
+  std::vector<std::string> files = {(directory / "black.ppm").string(),
+                                    (directory / "image.ppm").string()};
+  write_ppm(files[0], black);
+  write_ppm(files[1], image);
+  BatchOptions batch;
+  batch.output_dir = (directory / "out").string();
+  batch.journal = (directory / "journal").string();
+
+  BatchSummary first = run_batch(files, options, {}, batch);
+  BatchSummary second = run_batch(files, options, {}, batch);
+  check(first.failed == 1 && first.processed == 1 && second.failed == 1 &&
+            second.skipped == 1,
+        "failing input is reported and the batch goes on");
+}
+
+} // namespace
+
+int main(const int argc, const char **argv) {
+  if (argc < 2) {
+    std::cerr << "usage: regression <scratch directory>" << std::endl;
+    return 2;
+  }
+  fs::path scratch = argv[1];
+
+  std::vector<TestImage> images;
+  uint32_t seed = 1;
+  for (const SynthImage &spec : TEST_IMAGES) {
+    images.push_back({spec, synthesize(spec, seed++)});
+  }
+
+  StageParameters custom;
+  custom.denoise_count = 3;
+  custom.denoise_radius = 4;
+  custom.blur_count = 6;
+  custom.blur_radius = 2;
+  custom.certainty = 8;
+
+  for (const TestImage &image : images) {
+    std::cout << "-image " << image.spec.name << std::endl;
+    check_specialised(image);
+  }
+
+  for (const StageParameters &parameters : {StageParameters{}, custom}) {
+    PipelineOptions options;
+    options.verbose = false;
+    options.parameters = parameters;
+    std::cout << "-parameters: blur " << parameters.blur_count << "x"
+              << parameters.blur_radius << ", denoise "
+              << parameters.denoise_count << "x" << parameters.denoise_radius
+              << ", certainty " << parameters.certainty << std::endl;
+
+    for (const TestImage &image : images) {
+      std::cout << "-image " << image.spec.name << std::endl;
+      check_engines(image, options);
+      check_schedules(image, options);
+      check_edges(image, parameters);
+      check_smoothing(image, parameters);
+      check_blocking(image, parameters);
+      check_dialate(image, parameters);
+      check_convergence(image, parameters);
+      check_roi(image, options);
+      check_concurrent(image, options);
+      check_buffer_pool(image, options);
+      check_cache(image, options, scratch / "cache");
+    }
+    check_journal(images, options, scratch / "batch");
+    check_batch_failure(images.front(), options, scratch / "failure");
+  }
+
+  if (failures > 0) {
+    std::cout << "-" << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}